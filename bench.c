@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "simplefs.h"
+
+/**
+ * Микробенчмарк операций sfs_*: ./sfs_bench [-m bits] [-r reps] [-o file.json]
+ *      -m - размер виртуального диска 2^bits байт (по умолчанию 26)
+ *      -r - повторов format и mount/umount (по умолчанию 5)
+ *      -o - куда писать результат (по умолчанию stdout)
+ * Для каждого количества файлов из file_counts диск форматируется заново,
+ * затем измеряются create, open, close, mount, umount, delete, а для
+ * каждого размера запроса из io_sizes - последовательные append и read
+ * и случайное чтение. Каждая операция замеряется отдельно; в JSON для нее
+ * выводятся ops/s, MB/s (для операций с данными) и задержки p50/p99/p999.
+ *
+ * Смещения в API задать нельзя, поэтому случайное чтение - это чтение
+ * начала случайного файла: open + read + close одной операцией.
+ */
+
+#define DISKNAME "vdisk_sfs_bench.bin"
+
+static const int file_counts[] = {16, 256, 2048};
+static const int io_sizes[] = {64, 1024, 4096, 65536};
+
+#define SEQ_BYTES (8 * 1024 * 1024) // объем последовательных append/read на размер запроса
+#define FILL_BYTES 4096             // данные в каждом из файлов для случайного чтения
+#define RANDOM_READS 4000
+
+// Замеры одной операции
+typedef struct {
+    double *lat; // задержки в секундах
+    int count;
+    int cap;
+    long bytes;  // перенесенные данные
+} Sample;
+
+static FILE *out;
+static int results = 0; // сколько объектов уже выведено (для запятых)
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sample_add(Sample *s, double seconds) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->lat = realloc(s->lat, s->cap * sizeof(double));
+        if (s->lat == NULL) {
+            perror("sfs_bench");
+            exit(2);
+        }
+    }
+    s->lat[s->count++] = seconds;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Перцентиль по ближайшему рангу, массив уже отсортирован
+static double percentile(Sample *s, double p) {
+    int rank = (int) (p * s->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > s->count) rank = s->count;
+    return s->lat[rank - 1];
+}
+
+// Выводим результат операции op одним объектом JSON и очищаем замеры
+static void report(const char *op, int files, int io_size, Sample *s) {
+    if (s->count == 0) {
+        return;
+    }
+    double total = 0;
+    for (int i = 0; i < s->count; i++) {
+        total += s->lat[i];
+    }
+    qsort(s->lat, s->count, sizeof(double), compare_double);
+
+    fprintf(out, "%s\n    {\"op\": \"%s\", \"files\": %d, \"io_size\": %d, \"ops\": %d, "
+            "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+            "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}",
+            results++ ? "," : "", op, files, io_size, s->count, total,
+            total > 0 ? s->count / total : 0.0,
+            (s->bytes > 0 && total > 0) ? s->bytes / total / (1024 * 1024) : 0.0,
+            percentile(s, 0.50) * 1e6, percentile(s, 0.99) * 1e6, percentile(s, 0.999) * 1e6);
+    s->count = 0;
+    s->bytes = 0;
+}
+
+// Последовательные append и read одного файла запросами по io байт
+static int bench_sequential(int files, int io, char *buf) {
+    Sample s = {0};
+    double t;
+    int fd, n;
+
+    if (sfs_create("seq") != 0 || (fd = sfs_open("seq", MODE_APPEND)) < 0) {
+        return -1;
+    }
+    for (long done = 0; done < SEQ_BYTES; done += io) {
+        t = now();
+        n = sfs_append(fd, buf, io);
+        sample_add(&s, now() - t);
+        if (n != io) {
+            return -1;
+        }
+        s.bytes += n;
+    }
+    sfs_close(fd);
+    report("append", files, io, &s);
+
+    if ((fd = sfs_open("seq", MODE_READ)) < 0) {
+        return -1;
+    }
+    for (long done = 0; done < SEQ_BYTES; done += io) {
+        t = now();
+        n = sfs_read(fd, buf, io);
+        sample_add(&s, now() - t);
+        if (n != io) {
+            return -1;
+        }
+        s.bytes += n;
+    }
+    sfs_close(fd);
+    report("read_seq", files, io, &s);
+
+    free(s.lat);
+    return sfs_delete("seq");
+}
+
+// Все измерения для files файлов на свежеотформатированном диске
+static int bench_files(int files, int reps, char *buf) {
+    Sample s = {0};
+    char name[32];
+    double t;
+    int fd, ret;
+
+    for (int r = 0; r < reps; r++) {
+        t = now();
+        ret = sfs_format(DISKNAME);
+        sample_add(&s, now() - t);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    report("format", files, 0, &s);
+
+    for (int i = 0; i < files; i++) {
+        sprintf(name, "f%05d", i);
+        t = now();
+        ret = sfs_create(name);
+        sample_add(&s, now() - t);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    report("create", files, 0, &s);
+
+    // open и close замеряются по отдельности на одних и тех же файлах
+    Sample closes = {0};
+    for (int i = 0; i < files; i++) {
+        sprintf(name, "f%05d", i);
+        t = now();
+        fd = sfs_open(name, MODE_APPEND);
+        sample_add(&s, now() - t);
+        if (fd < 0) {
+            return -1;
+        }
+        sfs_append(fd, buf, FILL_BYTES); // данные для случайного чтения
+        t = now();
+        sfs_close(fd);
+        sample_add(&closes, now() - t);
+    }
+    report("open", files, 0, &s);
+    report("close", files, 0, &closes);
+    free(closes.lat);
+
+    // Монтирование читает таблицу записей, поэтому зависит от числа файлов
+    Sample umounts = {0};
+    for (int r = 0; r < reps; r++) {
+        t = now();
+        ret = sfs_umount();
+        sample_add(&umounts, now() - t);
+        t = now();
+        ret |= sfs_mount(DISKNAME);
+        sample_add(&s, now() - t);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    report("mount", files, 0, &s);
+    report("umount", files, 0, &umounts);
+    free(umounts.lat);
+
+    for (int k = 0; k < (int) (sizeof(io_sizes) / sizeof(io_sizes[0])); k++) {
+        int io = io_sizes[k];
+        if (bench_sequential(files, io, buf) != 0) {
+            return -1;
+        }
+        if (io > FILL_BYTES) {
+            continue;
+        }
+        for (int i = 0; i < RANDOM_READS; i++) {
+            sprintf(name, "f%05d", rand() % files);
+            t = now();
+            fd = sfs_open(name, MODE_READ);
+            ret = sfs_read(fd, buf, io);
+            sfs_close(fd);
+            sample_add(&s, now() - t);
+            if (ret != io) {
+                return -1;
+            }
+            s.bytes += ret;
+        }
+        report("read_random", files, io, &s);
+    }
+
+    for (int i = 0; i < files; i++) {
+        sprintf(name, "f%05d", i);
+        t = now();
+        ret = sfs_delete(name);
+        sample_add(&s, now() - t);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    report("delete", files, 0, &s);
+
+    free(s.lat);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int m = 26, reps = 5;
+    char *path = NULL;
+    char *buf;
+    int i, ret = 0;
+
+    for (i = 1; i < argc - 1; i += 2) {
+        if (strcmp(argv[i], "-m") == 0) {
+            m = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            reps = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            path = argv[i + 1];
+        } else {
+            break;
+        }
+    }
+    if (i != argc || reps <= 0) {
+        printf("usage: %s [-m bits] [-r reps] [-o file.json]\n", argv[0]);
+        return 2;
+    }
+
+    out = (path != NULL) ? fopen(path, "w") : stdout;
+    buf = malloc(io_sizes[sizeof(io_sizes) / sizeof(io_sizes[0]) - 1]);
+    if (out == NULL || buf == NULL) {
+        perror("sfs_bench");
+        return 2;
+    }
+    memset(buf, 'x', io_sizes[sizeof(io_sizes) / sizeof(io_sizes[0]) - 1]);
+    srand(1);
+
+    if (create_vdisk(DISKNAME, m) != 0 || sfs_mount(DISKNAME) != 0) {
+        fprintf(stderr, "sfs_bench: could not create or mount the disk\n");
+        return 2;
+    }
+
+    fprintf(out, "{\n  \"disk_bytes\": %ld, \"block_size\": %d,\n  \"results\": [", 1L << m, BLOCKSIZE);
+    for (i = 0; i < (int) (sizeof(file_counts) / sizeof(file_counts[0])); i++) {
+        if (bench_files(file_counts[i], reps, buf) != 0) {
+            fprintf(stderr, "sfs_bench: benchmark with %d files failed\n", file_counts[i]);
+            ret = 1;
+            break;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    sfs_umount();
+    remove(DISKNAME);
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(buf);
+    return ret;
+}
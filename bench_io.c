@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "simplefs.h"
+
+#define DISKNAME "vdisk_bench.bin"
+
+/**
+ * Сравнение буферизованного режима и режима O_DIRECT (MOUNT_DIRECT).
+ * Для каждого режима:
+ * 1. Создаем и форматируем виртуальный диск
+ * 2. Последовательно добавляем в файл SEQ_MB мегабайт кусками по CHUNK байт
+ * 3. Последовательно читаем этот файл
+ * 4. Делаем SMALL_APPENDS маленьких добавлений по SMALL_SIZE байт
+ * 5. Размонтируем диск (сюда входит fsync)
+ * Затем сравниваем надежное создание маленьких файлов: фиксация журнала
+ * после каждой операции (MOUNT_SYNC) и групповая фиксация одним sfs_sync.
+ *
+ * Запуск: ./bench_io [m], размер диска 2^m байт (по умолчанию 2^26)
+ */
+
+#define SEQ_MB 32
+#define CHUNK (64 * 1024)
+#define SMALL_APPENDS 20000
+#define SMALL_SIZE 100
+#define DURABLE_FILES 50
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char *name, int flags, int m, char *chunk) {
+    double t, format_time, write_time, read_time, small_time, umount_time;
+    int fd, i;
+    long total = (long) SEQ_MB * 1024 * 1024;
+
+    if (create_vdisk(DISKNAME, m) != 0 || sfs_mount_flags(DISKNAME, flags) != 0) {
+        printf("%s: could not create or mount the disk\n", name);
+        return -1;
+    }
+
+    t = now();
+    if (sfs_format(DISKNAME) != 0) {
+        printf("%s: format failed\n", name);
+        return -1;
+    }
+    format_time = now() - t;
+
+    sfs_create("seq.bin");
+    sfs_create("small.bin");
+
+    fd = sfs_open("seq.bin", MODE_APPEND);
+    t = now();
+    for (long done = 0; done < total; done += CHUNK) {
+        if (sfs_append(fd, chunk, CHUNK) != CHUNK) {
+            printf("%s: append failed\n", name);
+            return -1;
+        }
+    }
+    write_time = now() - t;
+    sfs_close(fd);
+
+    fd = sfs_open("seq.bin", MODE_READ);
+    t = now();
+    for (long done = 0; done < total; done += CHUNK) {
+        if (sfs_read(fd, chunk, CHUNK) != CHUNK) {
+            printf("%s: read failed\n", name);
+            return -1;
+        }
+    }
+    read_time = now() - t;
+    sfs_close(fd);
+
+    fd = sfs_open("small.bin", MODE_APPEND);
+    t = now();
+    for (i = 0; i < SMALL_APPENDS; i++) {
+        sfs_append(fd, chunk, SMALL_SIZE);
+    }
+    small_time = now() - t;
+    sfs_close(fd);
+
+    t = now();
+    sfs_umount();
+    umount_time = now() - t;
+
+    printf("%-9s %10.2f %12.1f %12.1f %14.0f %10.2f\n", name,
+           format_time * 1000, SEQ_MB / write_time, SEQ_MB / read_time,
+           SMALL_APPENDS / small_time, umount_time * 1000);
+    return 0;
+}
+
+static int run_durable(const char *name, int flags, int m, char *chunk) {
+    char filename[32];
+    double t;
+    int fd, i;
+
+    if (create_vdisk(DISKNAME, m) != 0 || sfs_mount_flags(DISKNAME, flags) != 0 ||
+        sfs_format(DISKNAME) != 0) {
+        printf("%s: could not prepare the disk\n", name);
+        return -1;
+    }
+
+    t = now();
+    for (i = 0; i < DURABLE_FILES; i++) {
+        sprintf(filename, "small%d.bin", i);
+        sfs_create(filename);
+        fd = sfs_open(filename, MODE_APPEND);
+        sfs_append(fd, chunk, SMALL_SIZE);
+        sfs_close(fd);
+    }
+    sfs_sync();
+    t = now() - t;
+
+    sfs_umount();
+    printf("%-12s %12.0f\n", name, DURABLE_FILES / t);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int m = (argc > 1) ? atoi(argv[1]) : 26;
+    char *chunk;
+
+    // Выровненный буфер: с O_DIRECT полные блоки пишутся из него без копирования
+    if (posix_memalign((void **) &chunk, 4096, CHUNK) != 0) {
+        return 1;
+    }
+
+    memset(chunk, 'x', CHUNK);
+    printf("disk 2^%d bytes, %d MB sequential, %d appends of %d bytes\n",
+           m, SEQ_MB, SMALL_APPENDS, SMALL_SIZE);
+    printf("%-9s %10s %12s %12s %14s %10s\n", "mode", "format_ms", "write_MB/s",
+           "read_MB/s", "small_ops/s", "umount_ms");
+    run("buffered", 0, m, chunk);
+    run("direct", MOUNT_DIRECT, m, chunk);
+
+    printf("\ndurable creation of %d files of %d bytes\n", DURABLE_FILES, SMALL_SIZE);
+    printf("%-12s %12s\n", "commit", "files/s");
+    run_durable("each_op", MOUNT_SYNC, m, chunk);
+    run_durable("group", 0, m, chunk);
+
+    remove(DISKNAME);
+    free(chunk);
+    return 0;
+}
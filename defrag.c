@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "simplefs.h"
+
+/**
+ * Дефрагментация виртуального диска: ./sfs_defrag [-b blocks] [-d ms] vdisk
+ *      -b - сколько блоков переносить за один шаг (по умолчанию 256)
+ *      -d - пауза между шагами в миллисекундах (по умолчанию 0)
+ * После каждого шага изменения фиксируются sfs_sync, так что прерванная
+ * дефрагментация теряет не больше одного шага.
+ */
+
+int main(int argc, char **argv)
+{
+    int step = 256, delay_ms = 0;
+    int moved = 0, steps = 0, n;
+    struct timespec start, end, pause;
+    int i;
+
+    for (i = 1; i < argc - 1; i += 2) {
+        if (strcmp(argv[i], "-b") == 0) {
+            step = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            delay_ms = atoi(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1 || step <= 0 || delay_ms < 0) {
+        printf("usage: %s [-b blocks] [-d ms] vdisk\n", argv[0]);
+        return 2;
+    }
+
+    if (sfs_mount(argv[argc - 1]) != 0) {
+        return 2;
+    }
+
+    pause.tv_sec = delay_ms / 1000;
+    pause.tv_nsec = (long) (delay_ms % 1000) * 1000000;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((n = sfs_defrag(step)) > 0) {
+        moved += n;
+        steps++;
+        if (sfs_sync() != 0) {
+            n = -1;
+            break;
+        }
+        if (delay_ms > 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sfs_umount();
+
+    printf("defrag: %s: %d blocks moved in %d steps, %.1f ms\n", argv[argc - 1], moved, steps,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return n < 0 ? 2 : 0;
+}
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <string.h>
+#include "simplefs.h"
+
+/**
+ * Проверка виртуального диска: ./sfs_fsck [-f] vdisk
+ *      -f - исправить найденные ошибки
+ * Код возврата: 0 - ошибок нет, 1 - найдены ошибки, 2 - проверить не удалось
+ */
+
+int main(int argc, char **argv)
+{
+    int flags = 0;
+    int ret;
+
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        flags = FSCK_FIX;
+    } else if (argc != 2) {
+        printf("usage: %s [-f] vdisk\n", argv[0]);
+        return 2;
+    }
+
+    ret = sfs_fsck(argv[argc - 1], flags);
+    if (ret < 0) {
+        return 2;
+    }
+    return ret > 0 ? 1 : 0;
+}
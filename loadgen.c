@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "simplefs.h"
+
+/**
+ * Нагрузочный тест со смешанной нагрузкой из нескольких потоков:
+ * ./sfs_load [-t threads] [-d seconds] [-f files] [-x r:a:c:d] [-z s]
+ *            [-a min:max] [-S bytes] [-m bits] [-o file.json]
+ *      -t - наибольшее число потоков (по умолчанию число процессоров);
+ *           прогоны идут для 1, 2, 4, ... потоков и для самого -t
+ *      -d - длительность одного прогона в секундах (по умолчанию 2)
+ *      -f - количество ключей (файлов) (по умолчанию 1024)
+ *      -x - доли операций read:append:create:delete (по умолчанию 70:20:5:5)
+ *      -z - показатель распределения Ципфа для выбора ключа, 0 - равномерно
+ *           (по умолчанию 0.99)
+ *      -a - размеры добавлений, логарифмически равномерно от min до max
+ *           байт (по умолчанию 64:65536)
+ *      -S - файл, выросший больше S байт, обрезается до нуля перед
+ *           добавлением (по умолчанию 1 МБ), чтобы диск не заполнился
+ *      -m - размер виртуального диска 2^bits байт (по умолчанию 26)
+ *      -o - куда писать результат в JSON (по умолчанию stdout)
+ * Перед каждым прогоном диск форматируется и все файлы создаются с
+ * данными, так что прогоны начинаются с одинакового состояния.
+ *
+ * Библиотека не потокобезопасна (таблицы открытых файлов и каталога -
+ * общие глобальные данные), поэтому каждая операция (open + read/append +
+ * close и т.д.) выполняется под общей блокировкой драйвера. Кривая
+ * масштабирования показывает, сколько стоит эта сериализация.
+ */
+
+#define DISKNAME "vdisk_sfs_load.bin"
+#define READ_SIZE 65536
+
+enum { OP_READ, OP_APPEND, OP_CREATE, OP_DELETE, OP_COUNT };
+static const char *op_names[OP_COUNT] = {"read", "append", "create", "delete"};
+
+// Параметры нагрузки
+static int files = 1024;
+static int mix[OP_COUNT] = {70, 20, 5, 5};
+static double zipf_s = 0.99;
+static int append_min = 64, append_max = 65536;
+static int file_cap = 1024 * 1024;
+
+static double *zipf_cdf; // накопленные вероятности рангов 0..files-1
+static char *fill;       // данные для добавлений при подготовке диска
+static pthread_mutex_t sfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int stop;
+
+// Счетчики одного потока
+typedef struct {
+    pthread_t thread;
+    unsigned int seed;
+    long ops[OP_COUNT];
+    long misses[OP_COUNT]; // нет файла, файл уже есть и т.п.
+    long bytes;
+    char *buf;
+} Worker;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Случайное число в [0, 1) из состояния потока
+static double uniform(unsigned int *seed) {
+    return rand_r(seed) / ((double) RAND_MAX + 1);
+}
+
+static void zipf_init() {
+    double sum = 0;
+    zipf_cdf = malloc(files * sizeof(double));
+    if (zipf_cdf == NULL) {
+        perror("sfs_load");
+        exit(2);
+    }
+    for (int i = 0; i < files; i++) {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < files; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+// Ранг ключа по Ципфу: двоичный поиск в накопленных вероятностях
+static int zipf_key(unsigned int *seed) {
+    double u = uniform(seed);
+    int lo = 0, hi = files - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int append_size(unsigned int *seed) {
+    double lmin = log(append_min), lmax = log(append_max);
+    return (int) exp(lmin + (lmax - lmin) * uniform(seed));
+}
+
+// Одна операция над ключом key; 0 - выполнена, 1 - промах
+static int run_op(Worker *w, int op, int key) {
+    char name[32];
+    int fd, n, ret = 0;
+
+    sprintf(name, "k%06d", key);
+    pthread_mutex_lock(&sfs_lock);
+    switch (op) {
+    case OP_READ:
+        if ((fd = sfs_open(name, MODE_READ)) < 0) {
+            ret = 1;
+            break;
+        }
+        n = sfs_read(fd, w->buf, READ_SIZE);
+        w->bytes += (n > 0) ? n : 0;
+        sfs_close(fd);
+        break;
+    case OP_APPEND:
+        if ((fd = sfs_open(name, MODE_APPEND)) < 0) {
+            ret = 1;
+            break;
+        }
+        if (sfs_getsize(fd) > file_cap) {
+            sfs_truncate(fd, 0);
+        }
+        n = sfs_append(fd, w->buf, append_size(&w->seed));
+        w->bytes += (n > 0) ? n : 0;
+        sfs_close(fd);
+        break;
+    case OP_CREATE:
+        ret = (sfs_create(name) != 0);
+        break;
+    case OP_DELETE:
+        ret = (sfs_delete(name) != 0);
+        break;
+    }
+    pthread_mutex_unlock(&sfs_lock);
+    return ret;
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    while (!stop) {
+        int pick = rand_r(&w->seed) % 100, op = 0;
+        while (op < OP_COUNT - 1 && pick >= mix[op]) {
+            pick -= mix[op++];
+        }
+        if (run_op(w, op, zipf_key(&w->seed))) {
+            w->misses[op]++;
+        }
+        w->ops[op]++;
+    }
+    return NULL;
+}
+
+// Свежий диск: все ключи созданы, в каждом по одному добавлению
+static int prepare() {
+    char name[32];
+    unsigned int seed = 1;
+
+    if (sfs_format(DISKNAME) != 0) {
+        return -1;
+    }
+    for (int key = 0; key < files; key++) {
+        sprintf(name, "k%06d", key);
+        int fd;
+        if (sfs_create(name) != 0 || (fd = sfs_open(name, MODE_APPEND)) < 0) {
+            return -1;
+        }
+        sfs_append(fd, fill, append_size(&seed));
+        sfs_close(fd);
+    }
+    return sfs_sync();
+}
+
+// Прогон с threads потоками; результат - объект JSON в out
+static int run(FILE *out, int threads, int seconds, double base, double *rate) {
+    Worker *workers = calloc(threads, sizeof(Worker));
+    int started = 0;
+    long total = 0;
+
+    if (workers == NULL || prepare() == -1) {
+        free(workers);
+        return -1;
+    }
+    stop = 0;
+    double t = now();
+    for (; started < threads; started++) {
+        workers[started].seed = 12345 + started;
+        workers[started].buf = calloc(1, append_max > READ_SIZE ? append_max : READ_SIZE);
+        if (workers[started].buf == NULL ||
+            pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0) {
+            free(workers[started].buf);
+            break;
+        }
+    }
+    struct timespec pause = {seconds, 0};
+    nanosleep(&pause, NULL);
+    stop = 1;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    t = now() - t;
+
+    long ops[OP_COUNT] = {0}, misses[OP_COUNT] = {0}, bytes = 0;
+    for (int i = 0; i < started; i++) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            ops[op] += workers[i].ops[op];
+            misses[op] += workers[i].misses[op];
+        }
+        bytes += workers[i].bytes;
+        free(workers[i].buf);
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        total += ops[op];
+    }
+    *rate = total / t;
+
+    fprintf(out, "    {\"threads\": %d, \"seconds\": %.3f, \"ops\": %ld, \"ops_per_sec\": %.1f, "
+            "\"speedup\": %.3f, \"mb_per_sec\": %.2f",
+            started, t, total, *rate, base > 0 ? *rate / base : 1.0, bytes / t / (1024 * 1024));
+    for (int op = 0; op < OP_COUNT; op++) {
+        fprintf(out, ", \"%s\": {\"ops\": %ld, \"misses\": %ld}", op_names[op], ops[op], misses[op]);
+    }
+    fprintf(out, "}");
+    free(workers);
+    return (started == threads) ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus > 0 ? (int) cpus : 1;
+    int seconds = 2, m = 26;
+    char *path = NULL;
+    int i, ret = 0;
+
+    for (i = 1; i < argc - 1; i += 2) {
+        if (strcmp(argv[i], "-t") == 0) {
+            max_threads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            seconds = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            files = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-x") == 0) {
+            if (sscanf(argv[i + 1], "%d:%d:%d:%d", &mix[0], &mix[1], &mix[2], &mix[3]) != 4) {
+                break;
+            }
+        } else if (strcmp(argv[i], "-z") == 0) {
+            zipf_s = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "-a") == 0) {
+            if (sscanf(argv[i + 1], "%d:%d", &append_min, &append_max) != 2) {
+                break;
+            }
+        } else if (strcmp(argv[i], "-S") == 0) {
+            file_cap = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            m = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            path = argv[i + 1];
+        } else {
+            break;
+        }
+    }
+    if (i != argc || max_threads <= 0 || seconds <= 0 || files <= 0 || zipf_s < 0 ||
+        append_min <= 0 || append_max < append_min || file_cap < 0 ||
+        mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[3] < 0 || mix[0] + mix[1] + mix[2] + mix[3] != 100) {
+        printf("usage: %s [-t threads] [-d seconds] [-f files] [-x r:a:c:d] [-z s]\n"
+               "       [-a min:max] [-S bytes] [-m bits] [-o file.json]\n", argv[0]);
+        return 2;
+    }
+
+    FILE *out = (path != NULL) ? fopen(path, "w") : stdout;
+    if (out == NULL) {
+        perror("sfs_load");
+        return 2;
+    }
+    zipf_init();
+    fill = calloc(1, append_max);
+    if (fill == NULL) {
+        perror("sfs_load");
+        return 2;
+    }
+    if (create_vdisk(DISKNAME, m) != 0 || sfs_mount(DISKNAME) != 0) {
+        fprintf(stderr, "sfs_load: could not create or mount the disk\n");
+        return 2;
+    }
+
+    fprintf(out, "{\n  \"files\": %d, \"mix\": {\"read\": %d, \"append\": %d, \"create\": %d, \"delete\": %d},\n"
+            "  \"zipf\": %.3f, \"append_min\": %d, \"append_max\": %d, \"file_cap\": %d,\n  \"runs\": [\n",
+            files, mix[0], mix[1], mix[2], mix[3], zipf_s, append_min, append_max, file_cap);
+    double base = 0, rate;
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads;
+        }
+        if (threads > 1) {
+            fprintf(out, ",\n");
+        }
+        if (run(out, threads, seconds, base, &rate) != 0) {
+            fprintf(stderr, "sfs_load: run with %d threads failed\n", threads);
+            ret = 1;
+            break;
+        }
+        if (threads == 1) {
+            base = rate;
+        }
+        if (threads == max_threads) {
+            break;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    sfs_umount();
+    remove(DISKNAME);
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(zipf_cdf);
+    free(fill);
+    return ret;
+}
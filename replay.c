@@ -0,0 +1,371 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "simplefs.h"
+
+/**
+ * Воспроизведение журнала вызовов sfs_* (sfs_record_start) на новом диске:
+ * ./sfs_replay [-m bits] [-s speed] [-o file.json] calls.log
+ *      -m - размер виртуального диска 2^bits байт (по умолчанию 26)
+ *      -s - 0 - как можно быстрее (по умолчанию), 1 - с исходными
+ *           промежутками между вызовами, k - в k раз быстрее исходного
+ *      -o - куда писать результат в JSON (по умолчанию stdout)
+ * Диск форматируется, начальное состояние из строк "init" воссоздается
+ * (файлы заполняются нулями нужного размера), затем вызовы выполняются
+ * по порядку в одном потоке: библиотека все равно их сериализует.
+ * Дескрипторы из журнала отображаются на дескрипторы воспроизведения,
+ * пути раскодируются (%XX - байт, "-" - NULL).
+ * Для каждого вызова выводятся количество, расхождения результата с
+ * журналом, задержки воспроизведения p50/p99/p999 и записанные p50/p99,
+ * так что два прогона на разных версиях библиотеки можно сравнить.
+ * Если были расхождения, код возврата 1.
+ */
+
+#define DISKNAME "vdisk_sfs_replay.bin"
+#define MAX_FDS 4096
+#define FILL_CHUNK 65536
+
+enum { C_FORMAT, C_CREATE, C_MKDIR, C_OPEN, C_CLOSE, C_READ, C_APPEND, C_PWRITE, C_TRUNCATE,
+       C_FALLOCATE, C_DELETE, C_STAT, C_SYNC, C_DEFRAG, C_COUNT };
+static const char *call_names[C_COUNT] = {
+    "format", "create", "mkdir", "open", "close", "read", "append", "pwrite", "truncate",
+    "fallocate", "delete", "stat", "sync", "defrag"
+};
+// Сколько числовых аргументов у вызова после имени (если оно есть)
+static const int call_args[C_COUNT] = {1, 0, 0, 1, 1, 2, 2, 3, 2, 2, 0, 0, 0, 1};
+static const int call_named[C_COUNT] = {0, 1, 1, 1, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0};
+
+// Один вызов из журнала
+typedef struct {
+    long long time_ns;
+    long long latency_ns; // записанная задержка
+    int call;
+    int args[3];
+    int ret;
+    char *name;
+} Call;
+
+static Call *calls;
+static int count, cap;
+static char **init_lines; // строки "init ..." начального состояния
+static int init_count;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int n, double p) {
+    int rank = (int) (p * n + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+// Путь из журнала: %XX - байт XX, "-" - путь NULL (sfs_record_start).
+// Раскодируем на месте; -1 - неправильная запись
+static int unescape(char *path, char **out) {
+    char *to = path;
+
+    if (strcmp(path, "-") == 0) {
+        *out = NULL;
+        return 0;
+    }
+    for (char *from = path; *from != '\0'; from++) {
+        unsigned int byte;
+        if (*from != '%') {
+            *to++ = *from;
+        } else if (isxdigit((unsigned char) from[1]) && isxdigit((unsigned char) from[2]) &&
+                   sscanf(from + 1, "%2x", &byte) == 1 && byte != 0) {
+            *to++ = (char) byte;
+            from += 2;
+        } else {
+            return -1;
+        }
+    }
+    *to = '\0';
+    *out = path;
+    return 0;
+}
+
+// Разбор строки вызова; -1 - строка неправильная
+static int parse_call(char *line, Call *c) {
+    char call[16], name[1024];
+    int thread, used;
+
+    if (sscanf(line, "%lld %d %lld %15s %n", &c->time_ns, &thread, &c->latency_ns, call, &used) != 4) {
+        return -1;
+    }
+    for (c->call = 0; c->call < C_COUNT && strcmp(call, call_names[c->call]) != 0; c->call++) {
+    }
+    if (c->call == C_COUNT) {
+        return -1;
+    }
+    line += used;
+    c->name = NULL;
+    if (call_named[c->call]) {
+        char *path;
+        if (sscanf(line, "%1023s %n", name, &used) != 1 || unescape(name, &path) != 0 ||
+            (path != NULL && (c->name = strdup(path)) == NULL)) {
+            return -1;
+        }
+        line += used;
+    }
+    for (int i = 0; i < call_args[c->call]; i++) {
+        if (sscanf(line, "%d %n", &c->args[i], &used) != 1) {
+            return -1;
+        }
+        line += used;
+    }
+    return (sscanf(line, "%d", &c->ret) == 1) ? 0 : -1;
+}
+
+static int load(const char *path) {
+    char line[2048];
+    int number = 0;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        perror("sfs_replay");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        number++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (strncmp(line, "init ", 5) == 0) {
+            init_lines = realloc(init_lines, (init_count + 1) * sizeof(char *));
+            if (init_lines == NULL || (init_lines[init_count++] = strdup(line + 5)) == NULL) {
+                perror("sfs_replay");
+                return -1;
+            }
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            calls = realloc(calls, cap * sizeof(Call));
+            if (calls == NULL) {
+                perror("sfs_replay");
+                return -1;
+            }
+        }
+        if (parse_call(line, &calls[count]) != 0) {
+            fprintf(stderr, "sfs_replay: %s:%d: bad line\n", path, number);
+            return -1;
+        }
+        count++;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Начальное состояние: каталоги и файлы нужного размера
+static int prepare(char *buf) {
+    char path[1024], *name;
+    int size, fd;
+
+    if (sfs_format(DISKNAME) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < init_count; i++) {
+        if (sscanf(init_lines[i], "mkdir %1023s", path) == 1) {
+            if (unescape(path, &name) != 0 || name == NULL || sfs_mkdir(name) != 0) {
+                return -1;
+            }
+        } else if (sscanf(init_lines[i], "file %1023s %d", path, &size) == 2) {
+            if (unescape(path, &name) != 0 || name == NULL ||
+                sfs_create(name) != 0 || (fd = sfs_open(name, MODE_APPEND)) < 0) {
+                return -1;
+            }
+            for (int done = 0; done < size; done += FILL_CHUNK) {
+                int n = (size - done < FILL_CHUNK) ? size - done : FILL_CHUNK;
+                if (sfs_append(fd, buf, n) != n) {
+                    return -1;
+                }
+            }
+            sfs_close(fd);
+        } else {
+            return -1;
+        }
+    }
+    return sfs_sync();
+}
+
+// Выполняем вызов c; fds - дескрипторы журнала -> дескрипторы воспроизведения
+static int execute(Call *c, int *fds, char *buf) {
+    int fd = (c->call == C_CLOSE || (c->call >= C_READ && c->call <= C_FALLOCATE)) &&
+             c->args[0] >= 0 && c->args[0] < MAX_FDS ? fds[c->args[0]] : -1;
+    SfsStat st;
+
+    switch (c->call) {
+    case C_FORMAT: return sfs_format_inline(DISKNAME, c->args[0]);
+    case C_CREATE: return sfs_create(c->name);
+    case C_MKDIR: return sfs_mkdir(c->name);
+    case C_OPEN: return sfs_open(c->name, c->args[0]);
+    case C_CLOSE: return sfs_close(fd);
+    case C_READ: return sfs_read(fd, buf, c->args[1]);
+    case C_APPEND: return sfs_append(fd, buf, c->args[1]);
+    case C_PWRITE: return sfs_pwrite(fd, buf, c->args[1], c->args[2]);
+    case C_TRUNCATE: return sfs_truncate(fd, c->args[1]);
+    case C_FALLOCATE: return sfs_fallocate(fd, c->args[1]);
+    case C_DELETE: return sfs_delete(c->name);
+    case C_STAT: return sfs_stat(c->name, &st);
+    case C_SYNC: return sfs_sync();
+    default: return sfs_defrag(c->args[0]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int m = 26;
+    double speed = 0;
+    char *path = NULL;
+    int i, ret = 0;
+
+    for (i = 1; i < argc - 1; i += 2) {
+        if (strcmp(argv[i], "-m") == 0) {
+            m = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            speed = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            path = argv[i + 1];
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1 || speed < 0) {
+        printf("usage: %s [-m bits] [-s speed] [-o file.json] calls.log\n", argv[0]);
+        return 2;
+    }
+    if (load(argv[argc - 1]) != 0) {
+        return 2;
+    }
+
+    // Буфер под самый большой запрос и заполнение начальных файлов
+    int buf_size = FILL_CHUNK;
+    for (i = 0; i < count; i++) {
+        if ((calls[i].call == C_READ || calls[i].call == C_APPEND || calls[i].call == C_PWRITE) &&
+            calls[i].args[1] > buf_size) {
+            buf_size = calls[i].args[1];
+        }
+    }
+    char *buf = calloc(1, buf_size);
+    double *lat = malloc((count > 0 ? count : 1) * sizeof(double));
+    int *fds = malloc(MAX_FDS * sizeof(int));
+    FILE *out = (path != NULL) ? fopen(path, "w") : stdout;
+    if (buf == NULL || lat == NULL || fds == NULL || out == NULL) {
+        perror("sfs_replay");
+        return 2;
+    }
+    for (i = 0; i < MAX_FDS; i++) {
+        fds[i] = -1;
+    }
+
+    if (create_vdisk(DISKNAME, m) != 0 || sfs_mount(DISKNAME) != 0 || prepare(buf) != 0) {
+        fprintf(stderr, "sfs_replay: could not prepare the disk\n");
+        return 2;
+    }
+
+    long long bytes = 0;
+    struct timespec origin;
+    clock_gettime(CLOCK_MONOTONIC, &origin);
+    long long first = (count > 0) ? calls[0].time_ns : 0;
+    double t = now();
+    for (i = 0; i < count; i++) {
+        Call *c = &calls[i];
+        if (speed > 0) {
+            // Ждем исходного момента вызова (в масштабе speed)
+            long long offset = (long long) ((c->time_ns - first) / speed);
+            struct timespec at = origin;
+            at.tv_sec += offset / 1000000000;
+            at.tv_nsec += offset % 1000000000;
+            if (at.tv_nsec >= 1000000000) {
+                at.tv_sec++;
+                at.tv_nsec -= 1000000000;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+        }
+        double start = now();
+        int result = execute(c, fds, buf);
+        lat[i] = now() - start;
+        if (c->call == C_OPEN && c->ret >= 0 && c->ret < MAX_FDS) {
+            fds[c->ret] = result;
+        } else if (c->call == C_CLOSE && c->args[0] >= 0 && c->args[0] < MAX_FDS) {
+            fds[c->args[0]] = -1;
+        }
+        if ((c->call == C_READ || c->call == C_APPEND || c->call == C_PWRITE) && result > 0) {
+            bytes += result;
+        }
+        // Расхождение: другой результат (для open - успех или ошибка)
+        c->ret = (c->call == C_OPEN) ? ((c->ret >= 0) != (result >= 0)) : (c->ret != result);
+    }
+    t = now() - t;
+
+    fprintf(out, "{\n  \"calls\": %d, \"init_entries\": %d, \"speed\": %.3f, \"seconds\": %.6f, "
+            "\"calls_per_sec\": %.1f, \"mb_per_sec\": %.2f,\n  \"results\": [",
+            count, init_count, speed, t, t > 0 ? count / t : 0.0, t > 0 ? bytes / t / (1024 * 1024) : 0.0);
+    double *replayed = malloc((count > 0 ? count : 1) * sizeof(double));
+    double *recorded = malloc((count > 0 ? count : 1) * sizeof(double));
+    if (replayed == NULL || recorded == NULL) {
+        perror("sfs_replay");
+        return 2;
+    }
+    int results = 0;
+    for (int call = 0; call < C_COUNT; call++) {
+        int n = 0, diverged = 0;
+        double total = 0;
+        for (i = 0; i < count; i++) {
+            if (calls[i].call == call) {
+                replayed[n] = lat[i];
+                recorded[n++] = calls[i].latency_ns / 1e9;
+                total += lat[i];
+                diverged += calls[i].ret;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        qsort(replayed, n, sizeof(double), compare_double);
+        qsort(recorded, n, sizeof(double), compare_double);
+        fprintf(out, "%s\n    {\"call\": \"%s\", \"count\": %d, \"diverged\": %d, \"seconds\": %.6f, "
+                "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, "
+                "\"recorded_p50_us\": %.3f, \"recorded_p99_us\": %.3f}",
+                results++ ? "," : "", call_names[call], n, diverged, total,
+                percentile(replayed, n, 0.50) * 1e6, percentile(replayed, n, 0.99) * 1e6,
+                percentile(replayed, n, 0.999) * 1e6,
+                percentile(recorded, n, 0.50) * 1e6, percentile(recorded, n, 0.99) * 1e6);
+        if (diverged > 0) {
+            ret = 1;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    sfs_umount();
+    remove(DISKNAME);
+    if (out != stdout) {
+        fclose(out);
+    }
+    for (i = 0; i < count; i++) {
+        free(calls[i].name);
+    }
+    for (i = 0; i < init_count; i++) {
+        free(init_lines[i]);
+    }
+    free(init_lines);
+    free(calls);
+    free(replayed);
+    free(recorded);
+    free(lat);
+    free(fds);
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "simplefs.h"
+
+/**
+ * Проверки файловой системы (ctest, make test): ./sfs_test case
+ *      crash_append, crash_truncate, crash_delete - процесс падает во время
+ *          большой операции без sfs_sync; после восстановления по журналу
+ *          файл цел, а sfs_fsck не находит ошибок
+ *      snapshot - снимок не меняется от pwrite, append, truncate и delete
+ *          на живом томе, после освобождения его блоки снова свободны
+ *      defrag - после дефрагментации данные те же, а sfs_fsck не находит ошибок
+ *      record [sfs_replay] - журнал вызовов с пробелами, '%', переводом
+ *          строки и NULL в путях воспроизводится без расхождений
+ * Код возврата: 0 - проверка прошла, 1 - нет.
+ */
+
+#define BIG_BYTES (70 << 20) // больше, чем помещается в одну транзакцию журнала
+#define SMALL_BYTES 5000
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+static char disk[64];
+static char *data; // эталонное содержимое: байт зависит от смещения
+
+static char pattern(int offset) {
+    return (char) (offset * 7 + offset / BLOCKSIZE);
+}
+
+// Совпадают ли первые size байт файла path с эталоном
+static int file_matches(char *path, int size) {
+    int fd = sfs_open(path, MODE_READ);
+    char *buf = malloc(size + 1);
+    int n = (fd >= 0 && buf != NULL) ? sfs_read(fd, buf, size + 1) : -1;
+    int ok = (n == size && memcmp(buf, data, size) == 0);
+    free(buf);
+    if (fd >= 0) {
+        sfs_close(fd);
+    }
+    return ok;
+}
+
+// Новый диск 2^m байт с файлом /big из size байт эталона
+static int make_disk(int m, int size) {
+    CHECK(create_vdisk(disk, m) == 0);
+    CHECK(sfs_mount(disk) == 0);
+    CHECK(sfs_format(disk) == 0);
+    CHECK(sfs_create("/big") == 0);
+    int fd = sfs_open("/big", MODE_APPEND);
+    CHECK(sfs_append(fd, data, size) == size);
+    CHECK(sfs_close(fd) == 0);
+    CHECK(sfs_umount() == 0);
+    return 0;
+}
+
+// Диск размонтирован и согласован
+static int disk_clean() {
+    CHECK(sfs_umount() == 0);
+    CHECK(sfs_fsck(disk, 0) == 0);
+    return 0;
+}
+
+
+/**********************************************************************
+   Сбой посреди большой операции
+***********************************************************************/
+
+static int crash_case;
+
+static void crash_op() {
+    int fd = sfs_open("/big", MODE_APPEND);
+    if (crash_case == 0) {
+        sfs_append(fd, data + SMALL_BYTES, BIG_BYTES - SMALL_BYTES);
+    } else if (crash_case == 1) {
+        sfs_truncate(fd, SMALL_BYTES);
+    } else {
+        sfs_close(fd);
+        sfs_delete("/big");
+    }
+}
+
+// Операция идет в дочернем процессе, который падает через delay_us
+// микросекунд (SIGALRM без обработчика завершает процесс) или, если
+// delay_us == 0, сразу после нее - без sfs_sync и sfs_umount
+static int crash_run(int delay_us) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (sfs_mount(disk) != 0) {
+            _exit(2);
+        }
+        if (delay_us > 0) {
+            ualarm(delay_us, 0);
+        }
+        crash_op();
+        _exit(0);
+    }
+    int status;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+    CHECK(!WIFEXITED(status) || WEXITSTATUS(status) == 0);
+    return 0;
+}
+
+// Первый прогон падает после операции и заодно меряет ее время (с
+// монтированием); следующие падают на разных долях этого времени
+static int test_crash(int which) {
+    static const int percent[] = { 0, 20, 50, 80, 95 };
+    int before = (which == 0) ? SMALL_BYTES : BIG_BYTES;
+    int duration_us = 0;
+
+    crash_case = which;
+    for (int i = 0; i < (int) (sizeof(percent) / sizeof(percent[0])); i++) {
+        struct timespec start, end;
+        int delay_us = (int) ((long long) duration_us * percent[i] / 100);
+        if (delay_us > 999999) delay_us = 999999; // предел ualarm
+        if (make_disk(27, before) != 0) {
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (crash_run(delay_us) != 0) {
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (i == 0) {
+            duration_us = (int) ((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+        }
+
+        // Монтирование повторяет журнал; файл - в состоянии до операции,
+        // после нее или (добавление) на границе шага, но всегда целый
+        SfsStats stats;
+        SfsStat st;
+        CHECK(sfs_reset_stats() == 0);
+        CHECK(sfs_mount(disk) == 0);
+        CHECK(sfs_get_stats(&stats) == 0);
+        if (sfs_stat("/big", &st) == 0) {
+            if (which == 0) {
+                CHECK(st.size >= SMALL_BYTES && st.size <= BIG_BYTES);
+            } else {
+                CHECK(st.size == BIG_BYTES || st.size == SMALL_BYTES);
+            }
+            CHECK(file_matches("/big", st.size));
+        } else {
+            CHECK(which == 2);
+        }
+        if (which == 0 && delay_us == 0) {
+            // Добавление шло несколькими транзакциями, до сбоя записались
+            // только целые шаги
+            CHECK(stats.journal_replays > 0);
+        }
+        printf("crash after %d us: size %d, %lld transactions replayed\n", delay_us,
+               (sfs_stat("/big", &st) == 0) ? st.size : -1, stats.journal_replays);
+
+        // Восстановленный диск согласован и пригоден для работы
+        if (disk_clean() != 0) {
+            return 1;
+        }
+        CHECK(sfs_mount(disk) == 0);
+        CHECK(sfs_create("/after") == 0);
+        int fd = sfs_open("/after", MODE_APPEND);
+        CHECK(sfs_append(fd, data, BIG_BYTES / 4) == BIG_BYTES / 4);
+        CHECK(sfs_close(fd) == 0);
+        CHECK(file_matches("/after", BIG_BYTES / 4));
+        if (disk_clean() != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**********************************************************************
+   Снимки
+***********************************************************************/
+
+// Заполняем диск файлом /fill и удаляем его; возвращает, сколько влезло
+static int fill_disk() {
+    static char chunk[64 * 1024];
+    int total = 0, n;
+    sfs_create("/fill");
+    int fd = sfs_open("/fill", MODE_APPEND);
+    while ((n = sfs_append(fd, chunk, sizeof(chunk))) > 0) {
+        total += n;
+    }
+    sfs_close(fd);
+    sfs_delete("/fill");
+    sfs_sync();
+    return total;
+}
+
+// Файл, выгруженный sfs_snapshot_export, совпадает с эталоном
+static int host_matches(const char *path, int size) {
+    FILE *file = fopen(path, "rb");
+    char *buf = malloc(size + 1);
+    int n = (file != NULL && buf != NULL) ? (int) fread(buf, 1, size + 1, file) : -1;
+    int ok = (n == size && memcmp(buf, data, size) == 0);
+    free(buf);
+    if (file != NULL) {
+        fclose(file);
+    }
+    return ok;
+}
+
+static int test_snapshot() {
+    char *other = malloc(SMALL_BYTES * 4);
+    char *buf = malloc(SMALL_BYTES * 4);
+    char dir[64], path[128];
+    SfsStat st, list[8];
+    CHECK(other != NULL && buf != NULL);
+    memset(other, 0x5a, SMALL_BYTES * 4);
+
+    CHECK(create_vdisk(disk, 23) == 0);
+    CHECK(sfs_mount(disk) == 0);
+    CHECK(sfs_format(disk) == 0);
+    int capacity = fill_disk();
+    CHECK(sfs_mkdir("/d") == 0);
+    char *names[] = { "/d/a", "/b", "/c" };
+    int sizes[] = { SMALL_BYTES * 2 + 100, SMALL_BYTES, 30 };
+    for (int i = 0; i < 3; i++) {
+        CHECK(sfs_create(names[i]) == 0);
+        int fd = sfs_open(names[i], MODE_APPEND);
+        CHECK(sfs_append(fd, data, sizes[i]) == sizes[i]);
+        CHECK(sfs_close(fd) == 0);
+    }
+
+    int snap = sfs_snapshot();
+    CHECK(snap >= 0);
+
+    // Живой том: перезапись части блока и целых блоков, добавление в
+    // неполный последний блок, усечение и удаление
+    int fd = sfs_open("/d/a", MODE_APPEND);
+    CHECK(sfs_pwrite(fd, other, 100, 10) == 100);
+    CHECK(sfs_pwrite(fd, other, 3 * BLOCKSIZE, 2 * BLOCKSIZE) == 3 * BLOCKSIZE);
+    CHECK(sfs_append(fd, other, SMALL_BYTES) == SMALL_BYTES);
+    CHECK(sfs_close(fd) == 0);
+    fd = sfs_open("/b", MODE_APPEND);
+    CHECK(sfs_truncate(fd, 100) == 0);
+    CHECK(sfs_append(fd, other, SMALL_BYTES) == SMALL_BYTES);
+    CHECK(sfs_close(fd) == 0);
+    CHECK(sfs_delete("/c") == 0);
+    CHECK(sfs_sync() == 0);
+
+    // Снимок видит прежнее содержимое всех трех файлов
+    for (int i = 0; i < 3; i++) {
+        CHECK(sfs_snapshot_stat(snap, names[i], &st) == 0 && st.size == sizes[i]);
+        CHECK(sfs_snapshot_read(snap, names[i], buf, SMALL_BYTES * 4, 0) == sizes[i]);
+        CHECK(memcmp(buf, data, sizes[i]) == 0);
+    }
+    CHECK(sfs_snapshot_read(snap, "/d/a", buf, 1000, 1500) == 1000 && memcmp(buf, data + 1500, 1000) == 0);
+    CHECK(sfs_snapshot_list(snap, "/", list, 8) == 3);
+    CHECK(sfs_snapshot_list(snap, "/d", list, 8) == 1 && strcmp(list[0].name, "a") == 0);
+
+    // Живой том видит новое содержимое
+    fd = sfs_open("/d/a", MODE_READ);
+    CHECK(sfs_read(fd, buf, SMALL_BYTES * 4) == sizes[0] + SMALL_BYTES);
+    CHECK(sfs_close(fd) == 0);
+    CHECK(memcmp(buf, data, 10) == 0 && memcmp(buf + 10, other, 100) == 0);
+    CHECK(memcmp(buf + 2 * BLOCKSIZE, other, 3 * BLOCKSIZE) == 0);
+    CHECK(memcmp(buf + sizes[0], other, SMALL_BYTES) == 0);
+    CHECK(sfs_stat("/c", &st) == -1);
+
+    // Выгрузка на хост
+    strcpy(dir, "/tmp/sfs_test.XXXXXX");
+    CHECK(mkdtemp(dir) != NULL);
+    CHECK(sfs_snapshot_export(snap, dir) == 0);
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s%s", dir, names[i]);
+        CHECK(host_matches(path, sizes[i]));
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/d", dir);
+    rmdir(path);
+    rmdir(dir);
+
+    // После освобождения снимка его блоки снова можно выделять
+    int live = 0;
+    for (int i = 0; i < 2; i++) {
+        CHECK(sfs_stat(names[i], &st) == 0);
+        live += st.blocks;
+    }
+    CHECK(sfs_snapshot_release(snap) == 0);
+    CHECK(sfs_snapshot_release(snap) == -1);
+    int after = fill_disk();
+    after = fill_disk(); // первый проход еще ждал освобождения отложенных цепочек
+    printf("capacity %d, after release %d, live blocks %d\n", capacity, after, live);
+    CHECK(after == capacity - live * BLOCKSIZE);
+    free(other);
+    free(buf);
+    return disk_clean();
+}
+
+
+/**********************************************************************
+   Дефрагментация
+***********************************************************************/
+
+static int test_defrag() {
+    char *names[] = { "/a", "/b", "/c" };
+    int fds[3];
+    int blocks = 3000;
+
+    CHECK(create_vdisk(disk, 24) == 0);
+    CHECK(sfs_mount(disk) == 0);
+    CHECK(sfs_format(disk) == 0);
+
+    // Три файла растут по блоку попеременно; /b и /c каждый раз открываются
+    // заново, поэтому их блоки перемешаны
+    for (int i = 0; i < 3; i++) {
+        CHECK(sfs_create(names[i]) == 0);
+    }
+    fds[0] = sfs_open(names[0], MODE_APPEND);
+    for (int k = 0; k < blocks; k++) {
+        CHECK(sfs_append(fds[0], data + k * BLOCKSIZE, BLOCKSIZE) == BLOCKSIZE);
+        for (int i = 1; i < 3; i++) {
+            fds[i] = sfs_open(names[i], MODE_APPEND);
+            CHECK(sfs_append(fds[i], data + k * BLOCKSIZE, BLOCKSIZE) == BLOCKSIZE);
+            CHECK(sfs_close(fds[i]) == 0);
+        }
+    }
+    CHECK(sfs_close(fds[0]) == 0);
+    CHECK(sfs_delete("/a") == 0);
+
+    int moved = 0, n;
+    while ((n = sfs_defrag(1000)) > 0) {
+        moved += n;
+    }
+    CHECK(n == 0);
+    CHECK(sfs_defrag(1000) == 0); // все файлы уже лежат непрерывно
+    printf("defrag moved %d blocks\n", moved);
+    CHECK(moved > 0);
+    for (int i = 1; i < 3; i++) {
+        CHECK(file_matches(names[i], blocks * BLOCKSIZE));
+    }
+    if (disk_clean() != 0) {
+        return 1;
+    }
+
+    // После повторного монтирования - те же данные
+    CHECK(sfs_mount(disk) == 0);
+    for (int i = 1; i < 3; i++) {
+        CHECK(file_matches(names[i], blocks * BLOCKSIZE));
+    }
+    return disk_clean();
+}
+
+
+/**********************************************************************
+   Журнал вызовов с необычными путями
+***********************************************************************/
+
+// Пишем журнал вызовов с пробелами, '%', переводом строки и NULL в путях
+// и воспроизводим его программой replay: каждый вызов - одна строка, и
+// результаты не расходятся с записанными
+static int test_record(const char *replay) {
+    char *names[] = { "/my dir/a b", "/my file", "/100%\n", "/tab\tx", "-" };
+    int count = sizeof(names) / sizeof(names[0]);
+    char log[80], line[2048];
+    SfsStat st;
+
+    snprintf(log, sizeof(log), "%s.log", disk);
+    CHECK(create_vdisk(disk, 22) == 0);
+    CHECK(sfs_mount(disk) == 0);
+    CHECK(sfs_format(disk) == 0);
+    CHECK(sfs_mkdir("/my dir") == 0);
+    CHECK(sfs_create(names[0]) == 0); // попадет в строку "init file"
+    int fd = sfs_open(names[0], MODE_APPEND);
+    CHECK(sfs_append(fd, data, SMALL_BYTES) == SMALL_BYTES);
+    CHECK(sfs_close(fd) == 0);
+
+    CHECK(sfs_record_start(log) == 0);
+    int calls = 0;
+    for (int i = 1; i < count; i++) {
+        CHECK(sfs_create(names[i]) == 0);
+        CHECK((fd = sfs_open(names[i], MODE_APPEND)) >= 0);
+        CHECK(sfs_append(fd, data, SMALL_BYTES) == SMALL_BYTES);
+        CHECK(sfs_close(fd) == 0);
+        calls += 4;
+    }
+    CHECK(sfs_stat(names[0], &st) == 0 && st.size == SMALL_BYTES);
+    CHECK(sfs_delete(names[1]) == 0);
+    CHECK(sfs_stat(names[1], &st) == -1);
+    CHECK(sfs_create(NULL) == -1);
+    CHECK(sfs_open(NULL, MODE_READ) == -1);
+    CHECK(sfs_stat(NULL, &st) == -1);
+    CHECK(sfs_delete(NULL) == -1);
+    calls += 7;
+    CHECK(sfs_record_stop() == 0);
+    if (disk_clean() != 0) {
+        return 1;
+    }
+
+    // Заголовок, две строки init (каталог и файл) и по строке на вызов
+    FILE *file = fopen(log, "r");
+    int lines = 0;
+    CHECK(file != NULL);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lines++;
+    }
+    fclose(file);
+    CHECK(lines == 1 + 2 + calls);
+
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        execl(replay, replay, "-m", "22", "-o", "/dev/null", log, (char *) NULL);
+        _exit(127);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    unlink(log);
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    static const char *cases[] = { "crash_append", "crash_truncate", "crash_delete", "snapshot", "defrag",
+                                   "record" };
+    int which = -1;
+    int ret;
+
+    for (int i = 0; (argc == 2 || argc == 3) && i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        if (strcmp(argv[1], cases[i]) == 0) {
+            which = i;
+        }
+    }
+    if (which == -1 || (argc == 3 && which != 5)) {
+        printf("usage: %s crash_append|crash_truncate|crash_delete|snapshot|defrag|record [sfs_replay]\n",
+               argv[0]);
+        return 2;
+    }
+
+    data = malloc(BIG_BYTES);
+    if (data == NULL) {
+        return 2;
+    }
+    for (int i = 0; i < BIG_BYTES; i++) {
+        data[i] = pattern(i);
+    }
+    snprintf(disk, sizeof(disk), "vdisk_sfs_test_%s.bin", cases[which]);
+
+    if (which <= 2) {
+        ret = test_crash(which);
+    } else if (which == 3) {
+        ret = test_snapshot();
+    } else if (which == 4) {
+        ret = test_defrag();
+    } else {
+        ret = test_record(argc == 3 ? argv[2] : "./sfs_replay");
+    }
+    if (ret == 0) {
+        unlink(disk);
+        printf("%s: ok\n", cases[which]);
+    }
+    free(data);
+    return ret;
+}
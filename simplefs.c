@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // для O_DIRECT
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
@@ -8,6 +9,14 @@
 #include "simplefs.h"
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <stdarg.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2/AVX2 для сравнения хешей имен
+#endif
 
 #define SUPERBLOCK_SIZE sizeof(SuperBlock)
 #define FAT_SIZE 1024
@@ -15,25 +24,168 @@
 #define NUM_DIR_ENTRIES 56
 #define BLOCKSIZE 1024 // Размер блока в байтах
 
+// Раскладка диска: суперблок, корневой каталог, FAT, журнал
+// метаданных, затем блоки данных
+#define ROOT_DIR_START 1
+#define ROOT_DIR_BLOCKS 7
+#define DIR_ENTRIES_PER_BLOCK (BLOCKSIZE / DIR_ENTRY_SIZE)
+#define FAT_START (ROOT_DIR_START + ROOT_DIR_BLOCKS)
+#define JOURNAL_BLOCKS 1024
+#define JOURNAL_START (FAT_START + FAT_SIZE)
+#define DATA_START (JOURNAL_START + JOURNAL_BLOCKS)
+
+// Запись FAT описывает блок с тем же номером: 0 - свободен,
+// FAT_EOC - последний блок файла, иначе номер следующего блока
+#define FAT_ENTRIES_PER_BLOCK (BLOCKSIZE / (int) sizeof(int))
+#define FAT_ENTRIES (FAT_SIZE * FAT_ENTRIES_PER_BLOCK)
+#define FAT_FREE 0
+#define FAT_EOC (-1)
+
+// Ввод-вывод идет строками по DIRECT_IO_ALIGN байт: это минимальная
+// единица для O_DIRECT и одновременно строка блочного кэша
+#define DIRECT_IO_ALIGN 4096
+#define CACHE_LINE_BLOCKS (DIRECT_IO_ALIGN / BLOCKSIZE)
+#define CACHE_LINES 64   // строк в блочном кэше (256 КиБ)
+#define STAGING_LINES 64 // строк в буфере пакетной записи (256 КиБ)
+
+// Пул буферов: память выделяется слябами, свободные буферы
+// хранятся в локальных списках потоков
+#define POOL_SLAB_BUFFERS 64 // буферов в одном слябе
+#define POOL_LOCAL_MAX 32    // больше этого поток возвращает буферы в общий список
+#define POOL_BATCH 16        // сколько буферов переносится между списками за раз
+
+// Журнал метаданных: первый блок - заголовок, дальше последовательно
+// транзакции вида "дескриптор, образы блоков, блок фиксации"
+#define JOURNAL_MAGIC 0x4a534653 // "SFSJ"
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+#define JOURNAL_LOG_START (JOURNAL_START + 1)
+#define JOURNAL_LOG_BLOCKS (JOURNAL_BLOCKS - 1)
+#define JOURNAL_TX_MAX ((BLOCKSIZE - 4 * sizeof(int)) / sizeof(int)) // блоков в транзакции
+// После стольких занятых блоков журнала делается контрольная точка:
+// это ограничивает объем, повторяемый при монтировании после сбоя
+#define JOURNAL_CHECKPOINT_BLOCKS 256
+// Транзакция фиксируется только между шагами операций. Шаг заранее
+// резервирует в ней место под блоки метаданных, которые может изменить
+#define JOURNAL_OP_BLOCKS 8      // шаг простой операции (создание, удаление, копия блока)
+#define APPEND_STEP_BLOCKS 4096  // блоков данных за один шаг добавления (4 МиБ)
+#define DEFRAG_STEP_BLOCKS 64    // блоков за один шаг дефрагментации
+
+// Отложенное освобождение: удаленные цепочки ждут в очереди в суперблоке
+// и освобождаются порциями при выделении блоков и в sfs_sync
+#define RECLAIM_MAX 64     // цепочек в очереди
+#define RECLAIM_BATCH 256  // блоков, освобождаемых за один шаг
+
+// Каждый дескриптор, открытый на добавление, выделяет блоки из своего
+// зарезервированного окна подряд идущих блоков: файлы, в которые пишут
+// попеременно, не перемешиваются блоками
+#define RESERVE_BLOCKS 64 // блоков в окне (64 КиБ)
+
 // Структуры данных
 typedef struct {
     int total_blocks;    // общее количество блоков
     int free_blocks;     // количество свободных блоков
     int fat_blocks;      // количество блоков для FAT
     int root_dir_blocks; // количество блоков для корневого каталога
+    int journal_blocks;  // количество блоков для журнала метаданных
+    int clean;           // 1 - диск размонтирован корректно, журнал пуст
+    int reclaim_count;   // цепочек в очереди отложенного освобождения
+    int reclaim[RECLAIM_MAX]; // первые блоки еще не освобожденных цепочек
+    int inline_max;      // файлы до стольких байт хранятся в записи каталога
+    int dir_ext;         // первый блок продолжения таблицы записей каталога, -1 - нет
 } SuperBlock;
 
-#define MAX_FILES 52 // Максимальное количество файлов в файловой системе
+// Заголовок журнала: с какой транзакции начинается непустой журнал
+typedef struct {
+    int magic;
+    int sequence;
+} JournalHeader;
+
+// Дескриптор транзакции: куда пишутся следующие за ним count образов
+typedef struct {
+    int magic;
+    int type;                   // JOURNAL_DESCRIPTOR
+    int sequence;               // номер транзакции
+    int count;                  // количество образов блоков
+    int blocks[JOURNAL_TX_MAX]; // номера блоков метаданных на диске
+} JournalDescriptor;
+
+// Блок фиксации: транзакция считается записанной, только если он цел
+typedef struct {
+    int magic;
+    int type;              // JOURNAL_COMMIT
+    int sequence;
+    unsigned int checksum; // контрольная сумма дескриптора и образов блоков
+} JournalCommit;
+
+#define INLINE_MAX 76 // Байт данных, помещающихся в запись каталога
+#define DIR_ENTRY_VERSION 2 // Версия формата записи каталога на диске
+#define DIR_TYPE_FILE 0
+#define DIR_TYPE_DIR 1
+#define DIR_ROOT (-1) // родитель записей корневого каталога
 
-// Запись в корневом каталоге
+// Запись каталога. Все записи всех каталогов лежат в одной таблице:
+// первые NUM_DIR_ENTRIES - в блоках корневого каталога, остальные - в
+// цепочке продолжения (superblock.dir_ext). Каталог - это запись типа
+// DIR_TYPE_DIR без данных, его файлы ссылаются на нее полем parent.
 typedef struct {
     char filename[32];   // имя файла (с учетом завершающего нуля)
     int size;            // размер файла в байтах
-    int first_block;     // номер первого блока данных
+    int first_block;     // номер первого блока данных (-1 - данные в inline_data)
+    int type;            // DIR_TYPE_FILE или DIR_TYPE_DIR
+    int parent;          // индекс записи родительского каталога, DIR_ROOT - корень
+    int children;        // записей в каталоге (только в памяти)
+    char inline_data[INLINE_MAX]; // данные маленького файла, у которого нет блоков
 } DirectoryEntry;
 
-static DirectoryEntry directory_entries[NUM_DIR_ENTRIES]; // Записи каталога
-static int files_count = 0; // Общее количество файлов в файловой системе
+// Запись каталога на диске. Формат фиксирован и не зависит от
+// DirectoryEntry: 128 байт (две строки кэша процессора), поля
+// выровнены по своему размеру, числа в порядке байтов little-endian.
+// Хеш имени лежит в начале записи, чтобы при поиске сравнивать его,
+// а не имя. version == 0 - запись свободна.
+typedef struct __attribute__((packed)) {
+    uint32_t name_hash;   // name_hash(filename)
+    uint8_t version;      // DIR_ENTRY_VERSION
+    uint8_t name_length;  // strlen(filename)
+    uint8_t type;         // DIR_TYPE_FILE или DIR_TYPE_DIR
+    uint8_t reserved;     // 0
+    int32_t size;         // размер файла в байтах
+    int32_t first_block;  // первый блок данных, -1 - данные в inline_data
+    int32_t parent;       // индекс записи родительского каталога, -1 - корень
+    char filename[32];    // имя, дополненное нулями
+    char inline_data[INLINE_MAX];
+} DiskDirEntry;
+
+_Static_assert(sizeof(DiskDirEntry) == DIR_ENTRY_SIZE, "on-disk directory entry must fill its slot");
+
+static DirectoryEntry *directory_entries = NULL; // Таблица записей каталогов
+static int dir_slots = 0;       // записей в таблице (NUM_DIR_ENTRIES + 8 на блок продолжения)
+static int *dir_ext_blocks = NULL; // блоки продолжения таблицы по порядку
+static int dir_free_hint = 0;   // с какой записи искать свободную
+static int root_children = 0;   // записей в корневом каталоге
+static int files_count = 0; // Общее количество файлов и каталогов в файловой системе
+
+// Блоки продолжения таблицы лежат в области данных; измененные в
+// текущей транзакции хранятся списком их порядковых номеров
+static int dir_ext_dirty[JOURNAL_TX_MAX];
+static int dir_ext_dirty_count = 0;
+
+// Индекс записей по ключу (родитель, имя) - кэш поиска по пути, в
+// котором есть все записи таблицы: путь разбирается по одной пробе на
+// компонент, без чтения блоков каталога. Открытая адресация корзинами
+// по DENTRY_BUCKET ключей; ключи корзины сравниваются одной векторной
+// инструкцией (dir_match), strcmp - только для совпавших.
+#define DENTRY_BUCKET 8
+#define DENTRY_EMPTY 0   // место в корзине не занималось: поиск здесь кончается
+#define DENTRY_DELETED 1 // запись удалена: поиск идет дальше
+typedef struct {
+    uint32_t keys[DENTRY_BUCKET]; // ключи dentry_key, DENTRY_EMPTY/DENTRY_DELETED
+    int slots[DENTRY_BUCKET];     // индексы записей в directory_entries
+} __attribute__((aligned(64))) DentryBucket;
+
+static DentryBucket *dentry_table = NULL;
+static int dentry_mask = 0; // корзин - 1 (степень двойки)
+static int dentry_used = 0; // занятых и удаленных мест
 
 #define MAX_OPEN_FILES 10 // Максимальное количество открытых файлов
 
@@ -42,6 +194,13 @@ typedef struct {
     char filename[32]; // Имя файла
     int mode; // Режим (чтение или добавление)
     int current_size; // Текущий размер файла в байтах
+    int dir_index; // Индекс записи в каталоге
+    int position; // Позиция чтения в байтах
+    int cur_block; // Блок, содержащий позицию чтения (-1 - неизвестен)
+    int cur_index; // Порядковый номер cur_block в цепочке файла
+    int last_block; // Последний блок файла для добавления (-1 - неизвестен)
+    int reserve_start; // Первый блок окна, зарезервированного за дескриптором
+    int reserve_count; // Сколько блоков в окне осталось (0 - окна нет)
 } OpenFileEntry;
 
 // Таблица открытых файлов
@@ -54,10 +213,98 @@ void init_open_files() {
     }
 }
 
+#define MAX_OPEN_DIRS 8 // Максимальное количество одновременных просмотров каталога
+
+// Просмотр каталога (sfs_opendir): снимок записей на момент открытия.
+// Изменения каталога после sfs_opendir на просмотр не влияют, и
+// просмотр не мешает им.
+typedef struct {
+    SfsStat *entries; // снимок, NULL - запись таблицы свободна
+    int count;        // записей в снимке
+    int next;         // следующая выдаваемая запись
+} OpenDirEntry;
+
+static OpenDirEntry open_dirs[MAX_OPEN_DIRS];
+
 int vdisk_fd; // global virtual disk file descriptor
 // will be assigned with the sfs_mount call
 // any function in this file can use this.
 
+static int mount_flags = 0; // флаги MOUNT_* текущего монтирования
+
+static SuperBlock superblock; // суперблок смонтированного диска
+
+// FAT целиком хранится в памяти, как и каталог; измененные блоки
+// метаданных отмечаются в meta_dirty и попадают на диск только через
+// журнал при фиксации транзакции (journal_commit)
+static int fat[FAT_ENTRIES] __attribute__((aligned(DIRECT_IO_ALIGN)));
+static unsigned char meta_dirty[JOURNAL_START]; // блоки текущей транзакции
+static int meta_dirty_count = 0;
+static int journal_sequence = 1; // номер следующей транзакции
+static int journal_used = 0;     // занято блоков журнала после заголовка
+static char *journal_buf = NULL; // выровненный буфер записи транзакции
+static int alloc_hint = DATA_START; // с какого блока начинать поиск свободного
+
+// Состояние дефрагментации (sfs_defrag): файл переносится в непрерывный
+// экстент по частям, блоки экстента до переноса изъяты из free_map
+static int defrag_file = -1;   // индекс записи каталога переносимого файла, -1 - нет
+static int defrag_target = 0;  // первый блок экстента
+static int defrag_length = 0;  // длина экстента в блоках
+static int defrag_moved = 0;   // сколько блоков уже перенесено
+static int defrag_next = 0;    // с какой записи каталога продолжать поиск
+
+// Битовые карты распределителя (бит на блок, строятся по FAT при монтировании).
+// Блок, освобожденный в незафиксированной транзакции, нельзя выделять
+// заново: при сбое удаление откатится, а новые данные уже лягут в блок
+// старого файла. Такие блоки ждут фиксации в pending_map.
+#define MAP_WORDS (FAT_ENTRIES / 64)
+static uint64_t free_map[MAP_WORDS];    // 1 - блок свободен и его можно выделить
+static uint64_t pending_map[MAP_WORDS]; // 1 - блок освобожден в текущей транзакции
+
+// Снимки (sfs_snapshot): копии таблицы записей и FAT в памяти. Блоки
+// данных снимка общие с томом, пока том их не меняет: перед записью в
+// общий блок файл получает его копию, а освобожденный общий блок не
+// возвращается в free_map, пока его не отпустят все снимки.
+typedef struct {
+    DirectoryEntry *entries; // таблица записей на момент снимка
+    int slots;
+    int *fat;                // FAT на момент снимка
+    int total_blocks;
+} Snapshot;
+
+#define EXPORT_CHUNK (64 * BLOCKSIZE) // байт за одну запись sfs_snapshot_export
+
+static Snapshot *snapshots[SFS_MAX_SNAPSHOTS];
+static int snapshot_count = 0;
+static unsigned char *snapshot_refs = NULL; // сколько снимков ссылается на блок
+static uint64_t shared_map[MAP_WORDS];      // 1 - на блок ссылается снимок
+static uint64_t held_map[MAP_WORDS];        // 1 - том блок освободил, снимок держит
+
+// Блочный кэш (прямого отображения) и буфер пакетной записи.
+// Буферы выровнены на DIRECT_IO_ALIGN, чтобы их можно было
+// передавать в read/write при открытии диска с O_DIRECT.
+static int cache_tags[CACHE_LINES]; // номер строки диска в слоте, -1 - пусто
+static char *cache_lines[CACHE_LINES]; // буферы строк кэша из пула
+static char *staging = NULL;
+
+// Свободный буфер пула; указатель на следующий хранится в самом буфере
+typedef struct PoolBuffer {
+    struct PoolBuffer *next;
+} PoolBuffer;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static PoolBuffer *pool_global = NULL; // общий список, под pool_lock
+static __thread PoolBuffer *pool_local = NULL; // список текущего потока
+static __thread int pool_local_count = 0;
+static pthread_key_t pool_key; // для возврата буферов при завершении потока
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+int journal_commit();
+static void defrag_cancel(int dir_index);
+static void file_release(OpenFileEntry *file);
+static void snapshot_free_all();
+int find_free_block();
+
 
 // This function is simply used to a create a virtual disk
 // (a simple Linux file including all zeros) of the specified size.
@@ -67,7 +314,7 @@ int vdisk_fd; // global virtual disk file descriptor
 // size = 2^m Bytes
 int create_vdisk(char *vdiskname, int m) {
     // Вычисляем размер диска
-    int size = 1 << m; // 2^m
+    off_t size = (off_t) 1 << m; // 2^m
     // Открываем файл для записи
     int fd = open(vdiskname, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
@@ -75,432 +322,4028 @@ int create_vdisk(char *vdiskname, int m) {
         return -1; // Ошибка при создании файла
     }
 
-    // Заполняем файл нулями
-    char *buffer = calloc(size, sizeof(char)); // Выделяем память для заполнения
-    if (buffer == NULL) {
-        close(fd);
-        perror("Error allocating memory");
-        return -1; // Ошибка при выделении памяти
-    }
-
-    // Записываем заполненный нулями буфер в файл
-    ssize_t written = write(fd, buffer, size);
-    if (written != size) {
-        free(buffer);
+    // Файл создается разреженным: нули не пишутся, место на диске хоста
+    // занимают только реально записанные блоки
+    if (ftruncate(fd, size) == -1) {
         close(fd);
         perror("Error writing to virtual disk");
-        return -1; // Ошибка при записи в файл
+        return -1; // Ошибка при установке размера файла
     }
 
-    // Освобождаем память и закрываем файл
-    free(buffer);
     close(fd);
     return 0; // Успешное создание виртуального диска
 }
 
 
-
-
-// read block k from disk (virtual disk) into buffer block.
-// size of the block is BLOCKSIZE.
-// space for block must be allocated outside of this function.
-// block numbers start from 0 in the virtual disk.
-int read_block(void *block, int k) {
-    int n;
-    int offset;
-
-    offset = k * BLOCKSIZE; // Вычисляем смещение для блока k
-    lseek(vdisk_fd, (off_t) offset, SEEK_SET); // Устанавливаем указатель на смещение
-    n = read(vdisk_fd, block, BLOCKSIZE); // Читаем блок данных
-    if (n != BLOCKSIZE) {
-        printf("read error\n"); // Ошибка, если не все данные были прочитаны
-        return -1; // Возвращаем -1 в случае ошибки
+// Переносим до count буферов из списка from в список to
+static int pool_move(PoolBuffer **from, PoolBuffer **to, int count) {
+    int moved = 0;
+    while (moved < count && *from != NULL) {
+        PoolBuffer *buffer = *from;
+        *from = buffer->next;
+        buffer->next = *to;
+        *to = buffer;
+        moved++;
     }
-    return 0; // Возвращаем 0 в случае успеха
+    return moved;
 }
 
-// write block k into the virtual disk.
-int write_block (void *block, int k)
-{
-    int n;
-    int offset;
-
-    offset = k * BLOCKSIZE;
-    lseek(vdisk_fd, (off_t) offset, SEEK_SET);
-    n = write (vdisk_fd, block, BLOCKSIZE);
-    if (n != BLOCKSIZE) {
-        printf ("write error\n");
-        return (-1);
-    }
-    return 0;
+// Поток завершился: его свободные буферы возвращаются в общий список
+static void pool_thread_exit(void *unused) {
+    (void) unused;
+    pthread_mutex_lock(&pool_lock);
+    pool_move(&pool_local, &pool_global, pool_local_count);
+    pthread_mutex_unlock(&pool_lock);
+    pool_local_count = 0;
 }
 
+static void pool_key_init() {
+    pthread_key_create(&pool_key, pool_thread_exit);
+}
 
-/**********************************************************************
-   The following functions are to be called by applications directly.
-***********************************************************************/
+// Регистрируем поток, чтобы его список вернулся в пул при завершении
+static void pool_thread_register() {
+    pthread_once(&pool_key_once, pool_key_init);
+    pthread_setspecific(pool_key, &pool_local);
+}
 
-// В функции sfs_format
-int sfs_format(char *vdiskname) {
-    // Определим глобальные параметры файловой системы
-    SuperBlock superblock;
-    DirectoryEntry dir_entries[NUM_DIR_ENTRIES] = {0}; // все нули
-    char fat[FAT_SIZE * BLOCKSIZE] = {0}; // все нули, для FAT
-    int i;
-
-    // Заполнить суперблок информацией
-    superblock.total_blocks = (1 + 7 + 1024 + (128 * 1024)) / BLOCKSIZE; // расчет общего количества блоков
-    superblock.free_blocks = superblock.total_blocks; // все блоки свободны в начале
-    superblock.fat_blocks = 1024; // фиксированное количество блоков для FAT
-    superblock.root_dir_blocks = 7; // фиксированное количество блоков для корневого каталога
-
-    // Записать суперблок на диск
-    if (write_block(&superblock, 0) == -1) {
-        return -1; // Ошибка записи
-    }
+// Берем выровненный буфер на DIRECT_IO_ALIGN байт (содержимое не обнулено).
+// Обычно это снятие с локального списка потока без блокировок.
+void *block_buf_get() {
+    if (pool_local == NULL) {
+        pool_thread_register();
 
-    int dir_block_index = 0; // Индекс для записи в корневой каталог
-    // Записать корневой каталог (7 блоков)
-    for (i = 0; i < superblock.root_dir_blocks; ++i) {
-        if (write_block(&dir_entries[dir_block_index], i + 1) == -1) {
-            return -1; // Ошибка записи
+        pthread_mutex_lock(&pool_lock);
+        if (pool_global == NULL) {
+            // Общий список пуст - выделяем новый сляб
+            char *slab;
+            if (posix_memalign((void **) &slab, DIRECT_IO_ALIGN, (size_t) POOL_SLAB_BUFFERS * DIRECT_IO_ALIGN) == 0) {
+                for (int i = 0; i < POOL_SLAB_BUFFERS; i++) {
+                    PoolBuffer *buffer = (PoolBuffer *) (slab + (size_t) i * DIRECT_IO_ALIGN);
+                    buffer->next = pool_global;
+                    pool_global = buffer;
+                }
+            }
         }
-        dir_block_index += BLOCKSIZE / DIR_ENTRY_SIZE; // Перемещение к следующему блоку
-    }
-
-    // Записать FAT (1024 блока)
-    for (i = 0; i < FAT_SIZE; ++i) {
-        if (write_block(fat, i + superblock.root_dir_blocks + 1) == -1) {
-            return -1; // Ошибка записи
+        pool_local_count += pool_move(&pool_global, &pool_local, POOL_BATCH);
+        pthread_mutex_unlock(&pool_lock);
+        if (pool_local == NULL) {
+            return NULL; // Ошибка выделения памяти
         }
     }
 
-    return 0; // Успешное форматирование
+    PoolBuffer *buffer = pool_local;
+    pool_local = buffer->next;
+    pool_local_count--;
+    return buffer;
 }
 
-int sfs_mount(char *vdiskname) {
-    // Проверка имени диска
-    if (vdiskname == NULL) {
-        fprintf(stderr, "Error: Disk name is NULL\n");
-        return -1; // Ошибка: имя диска не может быть NULL
+// Возвращаем буфер в пул (в локальный список текущего потока)
+void block_buf_put(void *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    if (pool_local == NULL) {
+        pool_thread_register();
     }
+    PoolBuffer *buffer = buf;
+    buffer->next = pool_local;
+    pool_local = buffer;
+    pool_local_count++;
 
-    // Открыть виртуальный диск с разрешениями чтения и записи
-    vdisk_fd = open(vdiskname, O_RDWR);
-    if (vdisk_fd < 0) {
-        perror("Error opening virtual disk");
-        return -1; // Ошибка: не удалось открыть файл
+    if (pool_local_count > POOL_LOCAL_MAX) {
+        pthread_mutex_lock(&pool_lock);
+        pool_local_count -= pool_move(&pool_local, &pool_global, POOL_BATCH);
+        pthread_mutex_unlock(&pool_lock);
     }
+}
 
-    init_open_files(); // Инициализируем таблицу открытых файлов(Фикс)
-    // Успешное открытие диска
-    return 0;
+
+// Статистика операций (sfs_get_stats). У каждого потока свой блок
+// счетчиков: его меняет только сам поток (relaxed atomics, без
+// блокировок), sfs_get_stats суммирует блоки всех потоков. Блок
+// завершившегося потока отдается следующему новому потоку, счетчики
+// в нем продолжают копиться. sfs_reset_stats не обнуляет блоки (это
+// гонка с их владельцами), а запоминает текущую сумму как базу.
+typedef struct StatsBlock {
+    SfsStats stats;
+    int in_use; // 0 - поток завершился
+    struct StatsBlock *next;
+} StatsBlock;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static StatsBlock *stats_blocks = NULL; // все блоки, список под stats_lock
+static SfsStats stats_base;             // сумма на момент sfs_reset_stats, под stats_lock
+static __thread StatsBlock *stats_local = NULL;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static void stats_thread_exit(void *block) {
+    __atomic_store_n(&((StatsBlock *) block)->in_use, 0, __ATOMIC_RELEASE);
 }
 
-int sfs_umount ()
-{
-    fsync (vdisk_fd);
-    close (vdisk_fd);
-    return (0);
+static void stats_key_init() {
+    pthread_key_create(&stats_key, stats_thread_exit);
 }
 
-int sfs_create(char *filename) {
-    // Проверка имени файла
-    if (filename == NULL) {
-        return -1; // Ошибка: имя файла не может быть NULL
+// Блок счетчиков текущего потока; при первом обращении - свободный
+// блок из списка или новый
+static SfsStats *stats_thread() {
+    if (stats_local != NULL) {
+        return &stats_local->stats;
     }
-    if (strlen(filename) >= 32) {
-        return -1; // Ошибка: имя файла слишком длинное
+    pthread_once(&stats_key_once, stats_key_init);
+    pthread_mutex_lock(&stats_lock);
+    StatsBlock *block = stats_blocks;
+    while (block != NULL && __atomic_load_n(&block->in_use, __ATOMIC_ACQUIRE)) {
+        block = block->next;
     }
-
-    // Проверка на переполнение массива записей каталога
-    if (files_count >= MAX_FILES) {
-        return -1; // Ошибка: превышено максимальное количество файлов
+    if (block == NULL && (block = calloc(1, sizeof(StatsBlock))) != NULL) {
+        block->next = stats_blocks;
+        stats_blocks = block;
     }
-
-    // Поиск первого доступного места в записях каталога
-    int entry_index = -1;
-    for (int i = 0; i < NUM_DIR_ENTRIES; i++) {
-        if (directory_entries[i].filename[0] == '\0') { // Найдено свободное место
-            entry_index = i;
-            break;
-        }
+    if (block != NULL) {
+        block->in_use = 1;
     }
-
-    if (entry_index == -1) {
-        return -1; // Ошибка: нет свободного места в каталоге
+    pthread_mutex_unlock(&stats_lock);
+    if (block == NULL) {
+        static SfsStats lost; // памяти нет: считаем в никуда
+        return &lost;
     }
+    stats_local = block;
+    pthread_setspecific(stats_key, block);
+    return &block->stats;
+}
 
-    // Создание записи о файле
-    strcpy(directory_entries[entry_index].filename, filename);
-    directory_entries[entry_index].size = 0; // Новый файл пока пустой
-    directory_entries[entry_index].first_block = -1; // Временное значение для первого блока данных
-
-    files_count++; // Увеличение счетчика файлов
+// Счетчик меняет только его поток: обычные load/store без lock-префикса
+static inline void stats_add(long long *counter, long long value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
 
-    // Запись обновленных данных в корневой каталог на диск
-    if (write_block(&directory_entries, (entry_index / 8) + 1) == -1) {
-        return -1; // Ошибка записи в диск
-    }
+#define STAT_ADD(field, value) stats_add(&stats_thread()->field, (value))
 
-    return 0; // Успешное создание файла
+static long long stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-
-int sfs_open(char *filename, int mode) {
-    // Проверка имени файла
-    if (filename == NULL) {
-        return -1; // Ошибка: имя файла не может быть NULL
+// Корзина гистограммы: меньше 8 нс - по корзине на значение, дальше
+// каждая степень двойки делится на 8 корзин по трем битам после старшего
+static int stats_bucket(long long ns) {
+    if (ns < 8) {
+        return (ns < 0) ? 0 : (int) ns;
     }
+    int e = 63 - __builtin_clzll((unsigned long long) ns);
+    int bucket = (e - 2) * 8 + (int) ((ns >> (e - 3)) & 7);
+    return (bucket < SFS_HIST_BUCKETS) ? bucket : SFS_HIST_BUCKETS - 1;
+}
 
-    // Поиск файла в каталоге
-    for (int i = 0; i < NUM_DIR_ENTRIES; i++) {
-        if (strcmp(directory_entries[i].filename, filename) == 0) {
-            // Найден файл
-            // Проверка наличия места в таблице открытых файлов
-            for (int j = 0; j < MAX_OPEN_FILES; j++) {
-                if (open_files[j].fd == -1) { // Свободная запись
-                    // Заполнение структуры OpenFileEntry
-                    open_files[j].fd = j; // Для простоты используем индекс как fd
-                    strcpy(open_files[j].filename, filename);
-                    open_files[j].mode = mode;
-                    open_files[j].current_size = directory_entries[i].size; // Получаем размер файла
-
-                    // Возвращаем индекс как дескриптор файла
-                    return j;
-                }
-            }
-            return -1; // Ошибка: нет места для открытия файла
-        }
+// Нижняя граница корзины bucket в нс
+static long long stats_bucket_low(int bucket) {
+    if (bucket < 8) {
+        return bucket;
     }
+    int e = bucket / 8 + 2;
+    return (long long) (8 + bucket % 8) << (e - 3);
+}
 
-    return -1; // Ошибка: файл не найден
+// Операция op, начатая в start (stats_clock), закончилась
+static void stats_time(int op, long long start) {
+    long long ns = stats_clock() - start;
+    SfsLatency *latency = &stats_thread()->ops[op];
+    stats_add(&latency->count, 1);
+    stats_add(&latency->total_ns, ns);
+    stats_add(&latency->hist[stats_bucket(ns)], 1);
 }
 
-int sfs_close(int fd) {
-    // Проверка допустимости дескриптора файла
-    if (fd < 0 || fd >= MAX_OPEN_FILES) {
-        return -1; // Ошибка: недопустимый дескриптор
+// Сумма блоков всех потоков (SfsStats - только счетчики long long)
+static void stats_sum(SfsStats *sum) {
+    long long *dst = (long long *) sum;
+    memset(sum, 0, sizeof(SfsStats));
+    for (StatsBlock *block = stats_blocks; block != NULL; block = block->next) {
+        long long *src = (long long *) &block->stats;
+        for (size_t i = 0; i < sizeof(SfsStats) / sizeof(long long); i++) {
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
     }
+}
 
-    // Проверка, открыт ли файл
-    if (open_files[fd].fd == -1) {
-        return -1; // Ошибка: файл не открыт
+int sfs_get_stats(SfsStats *stats) {
+    if (stats == NULL) {
+        return -1;
     }
-
-    // Освобождаем запись в таблице открытых файлов
-    open_files[fd].fd = -1; // Устанавливаем в -1, чтобы отметить запись как свободную
-    memset(open_files[fd].filename, 0, sizeof(open_files[fd].filename)); // Очистим имя файла
-    open_files[fd].mode = 0; // Очистить режим
-    open_files[fd].current_size = 0; // Очистить текущий размер
-
-    return 0; // Успешное закрытие файла
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(stats);
+    long long *dst = (long long *) stats;
+    long long *base = (long long *) &stats_base;
+    for (size_t i = 0; i < sizeof(SfsStats) / sizeof(long long); i++) {
+        dst[i] -= base[i];
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
 }
 
+int sfs_reset_stats() {
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(&stats_base);
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+}
 
-int sfs_getsize(int fd) {
-    // Проверка диапазона дескриптора файла
-    if (fd < 0 || fd >= MAX_OPEN_FILES) {
-        return -1; // Ошибка: недопустимый дескриптор
+long long sfs_stats_percentile(const SfsLatency *latency, double p) {
+    if (latency == NULL || latency->count <= 0) {
+        return 0;
     }
-
-    // Проверка, что запись в таблице открытых файлов существует
-    if (open_files[fd].fd == -1) {
-        return -1; // Ошибка: файл не открыт
+    long long rank = (long long) (p * latency->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > latency->count) rank = latency->count;
+    long long seen = 0;
+    for (int bucket = 0; bucket < SFS_HIST_BUCKETS - 1; bucket++) {
+        seen += latency->hist[bucket];
+        if (seen >= rank) {
+            return stats_bucket_low(bucket + 1) - 1;
+        }
     }
+    return stats_bucket_low(SFS_HIST_BUCKETS - 1);
+}
 
-    // Получаем имя файла из открытого файла
-    char *filename = open_files[fd].filename;
+// Вывод статистики при размонтировании (MOUNT_STATS)
+static void stats_dump() {
+    static const char *names[SFS_OP_COUNT] = {
+        "open", "close", "create", "delete", "read", "append", "pwrite",
+        "truncate", "sync", "disk_read", "disk_write"
+    };
+    SfsStats stats;
 
-    // Поиск файла в каталоге, чтобы получить его размер
-    for (int i = 0; i < NUM_DIR_ENTRIES; i++) {
-        if (strcmp(directory_entries[i].filename, filename) == 0) {
-            return directory_entries[i].size; // Возвращаем размер файла
+    sfs_get_stats(&stats);
+    fprintf(stderr, "sfs stats: %-10s %10s %10s %10s %10s %10s\n", "op", "count", "avg_us", "p50_us", "p99_us", "p999_us");
+    for (int op = 0; op < SFS_OP_COUNT; op++) {
+        SfsLatency *latency = &stats.ops[op];
+        if (latency->count == 0) {
+            continue;
         }
+        fprintf(stderr, "sfs stats: %-10s %10lld %10.2f %10.2f %10.2f %10.2f\n", names[op], latency->count,
+                latency->total_ns / 1e3 / latency->count,
+                sfs_stats_percentile(latency, 0.50) / 1e3, sfs_stats_percentile(latency, 0.99) / 1e3,
+                sfs_stats_percentile(latency, 0.999) / 1e3);
     }
-
-    return -1; // Ошибка: файл не найден в каталоге
+    fprintf(stderr, "sfs stats: read_block %lld, write_block %lld, blocks read %lld, blocks written %lld\n",
+            stats.read_block, stats.write_block, stats.blocks_read, stats.blocks_written);
+    fprintf(stderr, "sfs stats: cache hits %lld, misses %lld; fat allocs %lld, frees %lld; journal commits %lld, replays %lld\n",
+            stats.cache_hits, stats.cache_misses, stats.fat_allocs, stats.fat_frees, stats.journal_commits,
+            stats.journal_replays);
+    fprintf(stderr, "sfs stats: copy-on-write blocks %lld\n", stats.cow_blocks);
+    fprintf(stderr, "sfs stats: bytes read %lld, written %lld\n", stats.bytes_read, stats.bytes_written);
 }
 
 
-int sfs_read(int fd, void *buf, int n) {
-    // Проверка допустимости дескриптора файла
-    if (fd < 0 || fd >= MAX_OPEN_FILES) {
-        return -1; // Ошибка: недопустимый дескриптор
-    }
+// Трассировка блочного ввода-вывода (sfs_trace_start). Поток занимает
+// слот кольца одним атомарным сложением с trace_head. Запись в слоте
+// защищена последовательным номером как seqlock: seq обнуляется до
+// записи полей и получает номер записи после, так что sfs_trace_dump
+// пропускает записи, перезаписанные во время копирования.
+static SfsTraceRecord *trace_ring = NULL;
+static unsigned long long trace_mask = 0;
+static unsigned long long trace_head = 0; // сколько записей занято всего
+static long long trace_epoch = 0;         // stats_clock() при старте
+static int trace_on = 0;
+static int trace_threads = 0;
+static __thread int trace_thread = -1;
+static __thread int trace_call = SFS_CALL_OTHER; // текущий вызов sfs_* потока
 
-    // Проверка, открыт ли файл
-    if (open_files[fd].fd == -1) {
-        return -1; // Ошибка: файл не открыт
+// Номер потока в трассе и журнале вызовов, по порядку первого обращения
+static int thread_index() {
+    if (trace_thread == -1) {
+        trace_thread = __atomic_fetch_add(&trace_threads, 1, __ATOMIC_RELAXED);
     }
+    return trace_thread;
+}
 
-    // Получаем имя файла из открытого файла
-    char *filename = open_files[fd].filename;
+// Начало операции op: ее время для статистики и вызов для трассировки
+static long long stats_start(int op) {
+    trace_call = op;
+    return stats_clock();
+}
 
-    // Поиск файла в каталоге, чтобы получить информацию о его размере и первом блоке данных
-    for (int i = 0; i < NUM_DIR_ENTRIES; i++) {
-        if (strcmp(directory_entries[i].filename, filename) == 0) {
-            int file_size = directory_entries[i].size; // Получаем размер файла
-            int first_block = directory_entries[i].first_block; // Получаем номер первого блока
-            if (file_size == 0) {
-                return 0; // Файл пустой, возвращаем 0
-            }
+// Время начала операции ввода-вывода, 0 - трассировка выключена
+static inline long long trace_clock() {
+    return __atomic_load_n(&trace_on, __ATOMIC_RELAXED) ? stats_clock() : 0;
+}
 
-            // Определяем количество байт, которые нужно прочитать
-            int bytes_to_read = (n > file_size) ? file_size : n; // Определяем, сколько байт нужно прочитать
-            int total_read = 0; // Общее количество прочитанных байтов
+// Запись об операции с блоками block..block+count-1, начатой в start
+static void trace_io(long long start, int op, int flags, int block, int count) {
+    if (start == 0 || !__atomic_load_n(&trace_on, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    long long end = stats_clock();
+    unsigned long long index = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    SfsTraceRecord *record = &trace_ring[index & trace_mask];
 
-            char block[BLOCKSIZE]; // Буфер для загрузки блока
-            int current_block = first_block;
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->time_ns = start - trace_epoch;
+    record->block = block;
+    record->count = count;
+    record->latency_ns = (end - start > 0xffffffffLL) ? 0xffffffffu : (unsigned int) (end - start);
+    record->op = op;
+    record->flags = flags;
+    record->call = trace_call;
+    record->thread = thread_index();
+    __atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
+}
 
-            // Читаем последовательно блоки, связанные с файлом
-            while (total_read < bytes_to_read) {
-                // Читаем текущий блок
-                if (read_block(block, current_block) == -1) {
-                    return -1; // Ошибка чтения блока
-                }
+int sfs_trace_start(int records) {
+    if (records <= 0 || records > (1 << 28)) {
+        return -1;
+    }
+    unsigned long long size = 1;
+    while (size < (unsigned long long) records) {
+        size *= 2;
+    }
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+    free(trace_ring);
+    trace_ring = calloc(size, sizeof(SfsTraceRecord));
+    if (trace_ring == NULL) {
+        return -1;
+    }
+    trace_mask = size - 1;
+    trace_head = 0;
+    trace_epoch = stats_clock();
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
-                // Определяем сколько байтов копировать из блока
-                int bytes_in_block = (total_read + BLOCKSIZE > bytes_to_read) ?
-                                     bytes_to_read - total_read : BLOCKSIZE;
+int sfs_trace_stop() {
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+    return 0;
+}
 
-                // Копируем данные в буфер
-                memcpy(buf + total_read, block, bytes_in_block);
-                total_read += bytes_in_block;
+int sfs_trace_dump(char *path) {
+    if (path == NULL || trace_ring == NULL) {
+        return -1;
+    }
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
 
-                // Получаем следующий блок из FAT
-                uint64_t fat_entry;
-                if (read_block(&fat_entry, current_block) == -1) {
-                    return -1; // Ошибка чтения FAT
-                }
-                current_block = fat_entry; // Передаем указатель на следующий блок
-                if (current_block == 0) break; // Если reached end of file
-            }
+    unsigned long long head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    unsigned long long first = (head > trace_mask + 1) ? head - (trace_mask + 1) : 0;
+    SfsTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SFS_TRACE_MAGIC, sizeof(header.magic));
+    header.version = SFS_TRACE_VERSION;
+    header.record_size = sizeof(SfsTraceRecord);
+    header.block_size = BLOCKSIZE;
+    header.cache_line_blocks = CACHE_LINE_BLOCKS;
+    header.cache_lines = CACHE_LINES;
+    header.fat_start = FAT_START;
+    header.journal_start = JOURNAL_START;
+    header.data_start = DATA_START;
+    // Количество записей заполняется после копирования
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
 
-            return total_read; // Возвращаем количество успешно прочитанных байтов
+    long long written = 0;
+    for (unsigned long long index = first; ok && index < head; index++) {
+        SfsTraceRecord *slot = &trace_ring[index & trace_mask];
+        SfsTraceRecord copy;
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != index + 1) {
+            continue; // запись еще пишется или уже перезаписана
         }
+        memcpy(&copy, slot, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != index + 1) {
+            continue;
+        }
+        ok = fwrite(&copy, sizeof(copy), 1, file) == 1;
+        written++;
+    }
+    header.records = written;
+    header.dropped = first;
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fclose(file) != 0 || !ok) {
+        return -1;
     }
-    return -1; // Ошибка: файл не найден в каталоге
+    return (int) written;
 }
 
 
-int find_free_block() {
-    // Загружаем таблицу FAT из диска в оперативную память
-    uint64_t fat[FAT_SIZE];
-    if (read_block(fat, 1 + 7) == -1) { // FAT начинается после корневого каталога
-        return -1; // Ошибка чтения FAT
-    }
+// Журнал вызовов sfs_* (sfs_record_start): текстовая строка на вызов
+// "время поток задержка вызов аргументы... результат", с размерами, но
+// без данных. Проверка в выключенном состоянии - одна загрузка указателя.
+static FILE *record_file = NULL;
+static long long record_epoch = 0;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    // Ищем первый свободный блок
-    for (int i = 0; i < FAT_SIZE; i++) {
-        if (fat[i] == 0) { // Если FAT запись равна 0, блок свободен
-            return i + 1 + 7; // Возвращаем номер блока; +1 из-за суперблока и +7 из-за корневого каталога
+// Путь в журнале - одно слово: пробелы, управляющие байты и '%' пишутся
+// как %XX, путь NULL - как "-" (а сам путь "-" - как %2D)
+static void record_path(FILE *file, const char *path) {
+    if (path == NULL) {
+        fputc('-', file);
+        return;
+    }
+    if (strcmp(path, "-") == 0) {
+        fputs("%2D", file);
+        return;
+    }
+    for (const unsigned char *p = (const unsigned char *) path; *p != '\0'; p++) {
+        if (*p <= ' ' || *p == 0x7f || *p == '%') {
+            fprintf(file, "%%%02X", *p);
+        } else {
+            fputc(*p, file);
         }
     }
-
-    return -1; // Если свободные блоки не найдены
 }
 
-
-int sfs_append(int fd, void *buf, int n) {
-    // Проверка допустимости дескриптора файла
-    if (fd < 0 || fd >= MAX_OPEN_FILES) {
-        return -1; // Ошибка: недопустимый дескриптор
+// Начало строки вызова, начатого в start (stats_clock); NULL - журнал
+// выключен. Иначе record_lock захвачен до record_end.
+static FILE *record_begin(long long start) {
+    if (__atomic_load_n(&record_file, __ATOMIC_ACQUIRE) == NULL) {
+        return NULL;
     }
-
-    // Проверка, открыт ли файл
-    if (open_files[fd].fd == -1) {
-        return -1; // Ошибка: файл не открыт
+    long long end = stats_clock();
+    pthread_mutex_lock(&record_lock);
+    if (record_file == NULL) {
+        pthread_mutex_unlock(&record_lock);
+        return NULL;
     }
+    fprintf(record_file, "%lld %d %lld ", start - record_epoch, thread_index(), end - start);
+    return record_file;
+}
 
-    char *filename = open_files[fd].filename;
-    int total_bytes_written = 0; // Общее количество записанных байтов
-
-    // Поиск файла в каталоге
-    for (int i = 0; i < NUM_DIR_ENTRIES; i++) {
-        if (strcmp(directory_entries[i].filename, filename) == 0) {
-            int first_block = directory_entries[i].first_block;
-
-            // Пока есть данные для записи
-            while (total_bytes_written < n) {
-                int free_block = find_free_block();
-                if (free_block == -1) {
-                    return total_bytes_written; // Возвращаем то, что было записано
-                }
-
-                // Подготовка блока данных для записи
-                char data_block[BLOCKSIZE] = {0};
-
-                // Если это первый блок, то прочитаем текущие данные
-                if (first_block != -1) {
-                    read_block(data_block, first_block);
-                }
+// Конец строки: результат вызова ret
+static void record_end(FILE *file, int ret) {
+    fprintf(file, " %d\n", ret);
+    pthread_mutex_unlock(&record_lock);
+}
 
-                // Скопируем данные в блок
-                int bytes_to_copy = n - total_bytes_written;
-                if (bytes_to_copy > BLOCKSIZE) bytes_to_copy = BLOCKSIZE;
+// Вызов, начатый в start, вернул ret; format - имя вызова и аргументы
+static void record_call(long long start, int ret, const char *format, ...) {
+    FILE *file = record_begin(start);
+    if (file == NULL) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vfprintf(file, format, args);
+    va_end(args);
+    record_end(file, ret);
+}
 
-                memcpy(data_block + (open_files[fd].current_size % BLOCKSIZE), (char *)buf + total_bytes_written, bytes_to_copy);
+// Вызов call с путем path; format - остальные аргументы
+static void record_named(long long start, int ret, const char *call, const char *path,
+                         const char *format, ...) {
+    FILE *file = record_begin(start);
+    if (file == NULL) {
+        return;
+    }
+    fprintf(file, "%s ", call);
+    record_path(file, path);
+    va_list args;
+    va_start(args, format);
+    vfprintf(file, format, args);
+    va_end(args);
+    record_end(file, ret);
+}
 
-                // Записываем блок обратно на диск
-                write_block(data_block, free_block);
+// Полный путь записи index таблицы entries (slots записей) в path
+// (size байт); -1 - не помещается
+static int entry_path(const DirectoryEntry *entries, int slots, int index, char *path, int size) {
+    int length = 0;
+    path[0] = '\0';
+    for (int i = index, depth = 0; i != DIR_ROOT; i = entries[i].parent, depth++) {
+        int name = strlen(entries[i].filename);
+        if (depth > slots || length + name + 2 > size) {
+            return -1;
+        }
+        memmove(path + name + 1, path, length + 1);
+        path[0] = '/';
+        memcpy(path + 1, entries[i].filename, name);
+        length += name + 1;
+    }
+    return 0;
+}
 
-                // Обновляем размер файла
-                directory_entries[i].size += bytes_to_copy;
-                open_files[fd].current_size += bytes_to_copy;
+// Глубина каждой занятой записи таблицы entries (0 - в корне) в depth;
+// возвращает наибольшую. Обход по глубине идет от родителей к детям.
+static int entry_depths(const DirectoryEntry *entries, int slots, int *depth) {
+    int max_depth = 0;
+    for (int i = 0; i < slots; i++) {
+        depth[i] = 0;
+        if (entries[i].filename[0] == '\0') {
+            continue;
+        }
+        for (int j = entries[i].parent; j != DIR_ROOT && depth[i] <= slots; j = entries[j].parent) {
+            depth[i]++;
+        }
+        if (depth[i] > max_depth) {
+            max_depth = depth[i];
+        }
+    }
+    return max_depth;
+}
 
-                // Если это первый блок, устанавливаем first_block
-                if (first_block == -1) {
-                    directory_entries[i].first_block = free_block;
-                }
+// Начальное состояние тома: каталоги и файлы с размерами, родители раньше
+// детей, чтобы воспроизведение могло их воссоздать
+static void record_tree(FILE *file) {
+    char path[1024];
+    int *depth = malloc((dir_slots > 0 ? dir_slots : 1) * sizeof(int));
 
-                // Подготовка к следующему блоку
-                total_bytes_written += bytes_to_copy;
-                first_block = free_block; // Приказы переход к новому блоку
+    if (depth == NULL) {
+        return;
+    }
+    int max_depth = entry_depths(directory_entries, dir_slots, depth);
+    for (int d = 0; d <= max_depth; d++) {
+        for (int i = 0; i < dir_slots; i++) {
+            if (directory_entries[i].filename[0] == '\0' || depth[i] != d ||
+                entry_path(directory_entries, dir_slots, i, path, sizeof(path)) == -1) {
+                continue;
+            }
+            if (directory_entries[i].type == DIR_TYPE_DIR) {
+                fputs("init mkdir ", file);
+                record_path(file, path);
+                fputc('\n', file);
+            } else {
+                fputs("init file ", file);
+                record_path(file, path);
+                fprintf(file, " %d\n", directory_entries[i].size);
             }
-            return total_bytes_written; // Возвращаем количество успешно добавленных байтов
         }
     }
-    return -1; // Файл не найден
+    free(depth);
 }
 
+int sfs_record_start(char *path) {
+    if (path == NULL) {
+        return -1;
+    }
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    sfs_record_stop();
+    fprintf(file, "# sfs calls %d\n", SFS_RECORD_VERSION);
+    if (superblock.total_blocks > 0) {
+        record_tree(file);
+    }
+    pthread_mutex_lock(&record_lock);
+    record_epoch = stats_clock();
+    __atomic_store_n(&record_file, file, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&record_lock);
+    return 0;
+}
 
+int sfs_record_stop() {
+    pthread_mutex_lock(&record_lock);
+    FILE *file = record_file;
+    __atomic_store_n(&record_file, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&record_lock);
+    return (file != NULL && fclose(file) != 0) ? -1 : 0;
+}
 
 
-int sfs_delete(char *filename) {
-    // Проверка имени файла
-    if (filename == NULL) {
-        return -1; // Ошибка: имя файла не может быть NULL
+// Выделяем выровненные буферы кэша и пакетной записи и очищаем кэш
+static int io_buffers_init() {
+    for (int i = 0; i < CACHE_LINES; i++) {
+        if (cache_lines[i] == NULL && (cache_lines[i] = block_buf_get()) == NULL) {
+            return -1;
+        }
+    }
+    if (staging == NULL &&
+        posix_memalign((void **) &staging, DIRECT_IO_ALIGN, (size_t) STAGING_LINES * DIRECT_IO_ALIGN) != 0) {
+        staging = NULL;
+        return -1;
     }
+    if (journal_buf == NULL &&
+        posix_memalign((void **) &journal_buf, DIRECT_IO_ALIGN, (JOURNAL_TX_MAX + 2) * BLOCKSIZE) != 0) {
+        journal_buf = NULL;
+        return -1;
+    }
+    for (int i = 0; i < CACHE_LINES; i++) {
+        cache_tags[i] = -1;
+    }
+    return 0;
+}
 
-    // Поиск файла в каталоге
-    for (int i = 0; i < NUM_DIR_ENTRIES; i++) {
-        if (strcmp(directory_entries[i].filename, filename) == 0) {
-            // Найден файл, который нужно удалить
-            int first_block = directory_entries[i].first_block;
+static void io_buffers_free() {
+    for (int i = 0; i < CACHE_LINES; i++) {
+        block_buf_put(cache_lines[i]);
+        cache_lines[i] = NULL;
+    }
+    free(staging);
+    free(journal_buf);
+    staging = NULL;
+    journal_buf = NULL;
+}
 
-            // Освобождение всех блоков, занятых файлом
-            while (first_block != -1) {
-                // Чтение записи FAT для текущего блока
-                uint64_t fat_entry;
-                read_block(&fat_entry, first_block);
+// Чтение/запись len байт по смещению offset одним системным вызовом
+static int disk_read(void *buf, off_t offset, size_t len) {
+    long long start = stats_clock();
+    ssize_t n = pread(vdisk_fd, buf, len, offset);
+    stats_time(SFS_OP_DISK_READ, start);
+    if (n != (ssize_t) len) {
+        printf("read error\n");
+        return -1;
+    }
+    return 0;
+}
 
-                // Помечаем блок как свободный, записываем 0 в FAT
-                fat_entry = 0; // Освободить блок
-                write_block(&fat_entry, first_block); // Записываем изменение в FAT
+static int disk_write(const void *buf, off_t offset, size_t len) {
+    long long start = stats_clock();
+    ssize_t n = pwrite(vdisk_fd, buf, len, offset);
+    stats_time(SFS_OP_DISK_WRITE, start);
+    if (n != (ssize_t) len) {
+        printf("write error\n");
+        return -1;
+    }
+    return 0;
+}
 
-                // Переход к следующему блоку, согласно записи FAT
-                first_block = (first_block + 1) % (FAT_SIZE * BLOCKSIZE / 8); // Пример перехода к следующему блоку в FAT
-            }
+// Возвращает указатель на блок k внутри строки кэша.
+// При промахе строка целиком (DIRECT_IO_ALIGN байт) читается с диска.
+static char *cache_block(int k) {
+    long long start = trace_clock();
+    int line = k / CACHE_LINE_BLOCKS;
+    int slot = line % CACHE_LINES;
+    char *data = cache_lines[slot];
 
-            // Удаляем запись из каталога
-            memset(directory_entries[i].filename, 0, sizeof(directory_entries[i].filename)); // Очищаем имя файла
-            directory_entries[i].size = 0; // Обнуляем размер
-            directory_entries[i].first_block = -1; // Устанавливаем первый блок в -1
+    if (cache_tags[slot] != line) {
+        STAT_ADD(cache_misses, 1);
+        cache_tags[slot] = -1;
+        if (disk_read(data, (off_t) line * DIRECT_IO_ALIGN, DIRECT_IO_ALIGN) == -1) {
+            return NULL;
+        }
+        cache_tags[slot] = line;
+        trace_io(start, SFS_TRACE_READ, SFS_TRACE_MISS, k, 1);
+    } else {
+        STAT_ADD(cache_hits, 1);
+        trace_io(start, SFS_TRACE_READ, SFS_TRACE_HIT, k, 1);
+    }
+    return data + (k % CACHE_LINE_BLOCKS) * BLOCKSIZE;
+}
 
-            return 0; // Успешное удаление файла
+// Обновляем блоки k..k+count-1 в кэше, если их строки уже закэшированы
+static void cache_update(const char *src, int k, int count) {
+    for (int i = 0; i < count; i++) {
+        int line = (k + i) / CACHE_LINE_BLOCKS;
+        int slot = line % CACHE_LINES;
+        if (cache_tags[slot] == line) {
+            memcpy(cache_lines[slot] + ((k + i) % CACHE_LINE_BLOCKS) * BLOCKSIZE,
+                   src + (size_t) i * BLOCKSIZE, BLOCKSIZE);
         }
     }
+}
+
+// read block k from disk (virtual disk) into buffer block.
+// size of the block is BLOCKSIZE.
+// space for block must be allocated outside of this function.
+// block numbers start from 0 in the virtual disk.
+int read_block(void *block, int k) {
+    STAT_ADD(read_block, 1);
+    char *cached = cache_block(k); // Находим блок в кэше или читаем его строку
+    if (cached == NULL) {
+        return -1; // Возвращаем -1 в случае ошибки
+    }
+    memcpy(block, cached, BLOCKSIZE);
+    return 0; // Возвращаем 0 в случае успеха
+}
 
-    return -1; // Ошибка: файл не найден в каталоге
-}
\ No newline at end of file
+// write block k into the virtual disk.
+int write_block (void *block, int k)
+{
+    long long start = trace_clock();
+    STAT_ADD(write_block, 1);
+    if (mount_flags & MOUNT_DIRECT) {
+        // С O_DIRECT пишем всю выровненную строку (read-modify-write через кэш)
+        char *cached = cache_block(k);
+        if (cached == NULL) {
+            return -1;
+        }
+        memcpy(cached, block, BLOCKSIZE);
+        int line = k / CACHE_LINE_BLOCKS;
+        if (disk_write(cached - (k % CACHE_LINE_BLOCKS) * BLOCKSIZE,
+                       (off_t) line * DIRECT_IO_ALIGN, DIRECT_IO_ALIGN) == -1) {
+            cache_tags[line % CACHE_LINES] = -1;
+            return -1;
+        }
+        trace_io(start, SFS_TRACE_WRITE, 0, k, 1);
+        return 0;
+    }
+
+    cache_update(block, k, 1);
+    if (disk_write(block, (off_t) k * BLOCKSIZE, BLOCKSIZE) == -1) {
+        return -1;
+    }
+    trace_io(start, SFS_TRACE_WRITE, 0, k, 1);
+    return 0;
+}
+
+// Записываем count подряд идущих блоков начиная с k.
+// В буферизованном режиме это один pwrite. С O_DIRECT полные строки
+// копятся в выровненном буфере и уходят пакетами до STAGING_LINES строк,
+// а неполные строки в начале и в конце дописываются через кэш.
+int write_blocks(void *buf, int k, int count) {
+    char *src = buf;
+    long long start = trace_clock();
+    int first = k, total = count;
+    STAT_ADD(blocks_written, count);
+
+    if (!(mount_flags & MOUNT_DIRECT)) {
+        cache_update(src, k, count);
+        if (disk_write(src, (off_t) k * BLOCKSIZE, (size_t) count * BLOCKSIZE) == -1) {
+            return -1;
+        }
+        trace_io(start, SFS_TRACE_WRITE, SFS_TRACE_BULK, first, total);
+        return 0;
+    }
+
+    int batch_line = 0; // первая строка диска в буфере пакетной записи
+    int batch_lines = 0; // количество строк в буфере
+    while (count > 0) {
+        int in_line = CACHE_LINE_BLOCKS - k % CACHE_LINE_BLOCKS;
+        if (in_line > count) {
+            in_line = count;
+        }
+
+        if (in_line == CACHE_LINE_BLOCKS && (uintptr_t) src % DIRECT_IO_ALIGN == 0) {
+            // Выровненный источник (например, буфер из пула): все полные
+            // строки пишем прямо из него, без копирования в буфер пакета
+            int lines = count / CACHE_LINE_BLOCKS;
+            if (batch_lines > 0) {
+                if (disk_write(staging, (off_t) batch_line * DIRECT_IO_ALIGN,
+                               (size_t) batch_lines * DIRECT_IO_ALIGN) == -1) {
+                    return -1;
+                }
+                batch_lines = 0;
+            }
+            if (disk_write(src, (off_t) k * BLOCKSIZE, (size_t) lines * DIRECT_IO_ALIGN) == -1) {
+                return -1;
+            }
+            cache_update(src, k, lines * CACHE_LINE_BLOCKS);
+            in_line = lines * CACHE_LINE_BLOCKS;
+        } else if (in_line == CACHE_LINE_BLOCKS) {
+            // Полная строка: добавляем в пакет
+            if (batch_lines == 0) {
+                batch_line = k / CACHE_LINE_BLOCKS;
+            }
+            memcpy(staging + (size_t) batch_lines * DIRECT_IO_ALIGN, src, DIRECT_IO_ALIGN);
+            cache_update(src, k, CACHE_LINE_BLOCKS);
+            batch_lines++;
+        } else {
+            // Неполная строка: сначала сбрасываем накопленный пакет
+            if (batch_lines > 0) {
+                if (disk_write(staging, (off_t) batch_line * DIRECT_IO_ALIGN,
+                               (size_t) batch_lines * DIRECT_IO_ALIGN) == -1) {
+                    return -1;
+                }
+                batch_lines = 0;
+            }
+            char *cached = cache_block(k);
+            if (cached == NULL) {
+                return -1;
+            }
+            memcpy(cached, src, (size_t) in_line * BLOCKSIZE);
+            int line = k / CACHE_LINE_BLOCKS;
+            if (disk_write(cached - (k % CACHE_LINE_BLOCKS) * BLOCKSIZE,
+                           (off_t) line * DIRECT_IO_ALIGN, DIRECT_IO_ALIGN) == -1) {
+                cache_tags[line % CACHE_LINES] = -1;
+                return -1;
+            }
+        }
+
+        if (batch_lines == STAGING_LINES) {
+            if (disk_write(staging, (off_t) batch_line * DIRECT_IO_ALIGN,
+                           (size_t) batch_lines * DIRECT_IO_ALIGN) == -1) {
+                return -1;
+            }
+            batch_lines = 0;
+        }
+        k += in_line;
+        src += (size_t) in_line * BLOCKSIZE;
+        count -= in_line;
+    }
+
+    if (batch_lines > 0 && disk_write(staging, (off_t) batch_line * DIRECT_IO_ALIGN,
+                                      (size_t) batch_lines * DIRECT_IO_ALIGN) == -1) {
+        return -1;
+    }
+    trace_io(start, SFS_TRACE_WRITE, SFS_TRACE_BULK, first, total);
+    return 0;
+}
+
+// Читаем count подряд идущих блоков мимо кэша (загрузка FAT при монтировании).
+// С O_DIRECT буфер и диапазон должны быть выровнены, иначе читаем поблочно.
+int read_blocks(void *buf, int k, int count) {
+    char *dst = buf;
+    STAT_ADD(blocks_read, count);
+
+    if ((mount_flags & MOUNT_DIRECT) &&
+        ((uintptr_t) dst % DIRECT_IO_ALIGN != 0 || k % CACHE_LINE_BLOCKS != 0 || count % CACHE_LINE_BLOCKS != 0)) {
+        for (int i = 0; i < count; i++) {
+            if (read_block(dst + (size_t) i * BLOCKSIZE, k + i) == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    long long start = trace_clock();
+    if (disk_read(dst, (off_t) k * BLOCKSIZE, (size_t) count * BLOCKSIZE) == -1) {
+        return -1;
+    }
+    trace_io(start, SFS_TRACE_READ, SFS_TRACE_BULK, k, count);
+    return 0;
+}
+
+
+// Отмечаем блок метаданных как измененный в текущей транзакции. Место
+// под него шаг операции зарезервировал заранее (journal_reserve), поэтому
+// здесь транзакция не фиксируется: на диск попала бы половина операции.
+static void meta_mark_dirty(int block) {
+    if (meta_dirty[block]) {
+        return;
+    }
+    meta_dirty[block] = 1;
+    meta_dirty_count++;
+}
+
+// Граница шагов операции: состояние в памяти согласовано. Если следующему
+// шагу, который меняет до blocks блоков метаданных, может не хватить места
+// в транзакции, она фиксируется сейчас.
+static int journal_reserve(int blocks) {
+    if (meta_dirty_count + blocks > (int) JOURNAL_TX_MAX) {
+        return journal_commit();
+    }
+    return 0;
+}
+
+// Поместится ли в текущую транзакцию изменение блока метаданных block
+static inline int journal_room(int block) {
+    return meta_dirty[block] || meta_dirty_count < (int) JOURNAL_TX_MAX;
+}
+
+// Изменение записи FAT с пометкой ее блока как измененного
+static void fat_set(int block, int value) {
+    fat[block] = value;
+    meta_mark_dirty(FAT_START + block / FAT_ENTRIES_PER_BLOCK);
+}
+
+// Устанавливаем биты блоков start..start+count-1 в карте (целыми словами)
+static void map_set_range(uint64_t *map, int start, int count) {
+    while (count > 0) {
+        int bit = start % 64;
+        int n = (64 - bit < count) ? 64 - bit : count;
+        uint64_t mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << bit;
+        map[start / 64] |= mask;
+        start += n;
+        count -= n;
+    }
+}
+
+// Есть ли в карте хоть один блок
+static int map_any(const uint64_t *map) {
+    for (int i = 0; i < MAP_WORDS; i++) {
+        if (map[i] != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Строим карту свободных блоков по FAT в памяти
+static void map_build() {
+    memset(free_map, 0, sizeof(free_map));
+    memset(pending_map, 0, sizeof(pending_map));
+    for (int block = DATA_START; block < superblock.total_blocks; block++) {
+        if (fat[block] == FAT_FREE) {
+            free_map[block / 64] |= 1ULL << (block % 64);
+        }
+    }
+}
+
+// Возвращаем хосту место блоков start..start+count-1 (MOUNT_PUNCH_HOLES)
+static void punch_hole(int start, int count) {
+    if (fallocate(vdisk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t) start * BLOCKSIZE, (off_t) count * BLOCKSIZE) == -1) {
+        mount_flags &= ~MOUNT_PUNCH_HOLES; // файловая система хоста не умеет - больше не пробуем
+    }
+}
+
+// Пробиваем дыры на месте освобожденных в транзакции блоков. Соседние
+// блоки из разных цепочек склеиваются в одну серию - один вызов fallocate.
+static void punch_pending() {
+    int run_start = -1, run_length = 0;
+    for (int i = 0; i < MAP_WORDS; i++) {
+        uint64_t bits = pending_map[i];
+        if (bits == 0) {
+            continue;
+        }
+        while (bits != 0) {
+            int block = i * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (run_length > 0 && block == run_start + run_length) {
+                run_length++;
+                continue;
+            }
+            if (run_length > 0) {
+                punch_hole(run_start, run_length);
+            }
+            run_start = block;
+            run_length = 1;
+        }
+    }
+    if (run_length > 0) {
+        punch_hole(run_start, run_length);
+    }
+}
+
+// Транзакция зафиксирована: освобожденные в ней блоки можно выделять.
+// Дыры пробиваются только теперь: до фиксации удаление может откатиться.
+static void map_release_pending() {
+    // Блоки, на которые ссылаются снимки, в FAT свободны, но выделять их
+    // нельзя, пока снимки их не отпустят
+    if (snapshot_count > 0) {
+        for (int i = 0; i < MAP_WORDS; i++) {
+            uint64_t held = pending_map[i] & shared_map[i];
+            held_map[i] |= held;
+            pending_map[i] &= ~held;
+        }
+    }
+    if (mount_flags & MOUNT_PUNCH_HOLES) {
+        punch_pending();
+    }
+    for (int i = 0; i < MAP_WORDS; i++) {
+        free_map[i] |= pending_map[i];
+        pending_map[i] = 0;
+    }
+}
+
+// Освобождаем до max_blocks блоков цепочки FAT начиная с *head; в *head
+// остается первый неосвобожденный блок (FAT_EOC, если цепочка кончилась).
+// Блоки уходят в pending_map непрерывными сериями, блоки FAT помечаются
+// измененными и попадут на диск одной записью каждый при фиксации.
+// Шаг целиком укладывается в текущую транзакцию: на блоке FAT, которому
+// в ней уже нет места, освобождение останавливается, так что записи FAT,
+// *head и счетчик свободных блоков всегда фиксируются вместе.
+static int free_chain(int *head, int max_blocks) {
+    int block = *head;
+    int freed = 0;
+    int run_start = -1, run_length = 0;
+    int limit = superblock.total_blocks - DATA_START;
+
+    if (max_blocks > limit) {
+        max_blocks = limit; // защита от зацикленной цепочки
+    }
+    if (!journal_room(0)) {
+        return 0;
+    }
+    while (block >= DATA_START && block < superblock.total_blocks && freed < max_blocks) {
+        if (!journal_room(FAT_START + block / FAT_ENTRIES_PER_BLOCK)) {
+            break; // Остаток - в следующей транзакции
+        }
+        int next = fat[block];
+        fat_set(block, FAT_FREE);
+        if (block != run_start + run_length) {
+            if (run_length > 0) {
+                map_set_range(pending_map, run_start, run_length);
+            }
+            run_start = block;
+            run_length = 0;
+        }
+        run_length++;
+        freed++;
+        block = next;
+    }
+    if (run_length > 0) {
+        map_set_range(pending_map, run_start, run_length);
+    }
+    if (freed > 0) {
+        superblock.free_blocks += freed;
+        meta_mark_dirty(0);
+        STAT_ADD(fat_frees, freed);
+    }
+    *head = (block >= DATA_START && block < superblock.total_blocks) ? block : FAT_EOC;
+    return freed;
+}
+
+// Шаг отложенного освобождения: до max_blocks блоков из очереди, но не
+// больше, чем помещается в текущую транзакцию
+static int reclaim_step(int max_blocks) {
+    int freed = 0;
+    while (freed < max_blocks && superblock.reclaim_count > 0 && journal_room(0)) {
+        int *head = &superblock.reclaim[superblock.reclaim_count - 1];
+        int n = free_chain(head, max_blocks - freed);
+        freed += n;
+        meta_mark_dirty(0);
+        if (*head == FAT_EOC) {
+            superblock.reclaim_count--; // цепочка освобождена целиком
+        } else if (freed < max_blocks) {
+            break; // Транзакция заполнена
+        }
+    }
+    return freed;
+}
+
+// Ставим цепочку head в очередь отложенного освобождения; на диске
+// меняется только суперблок. Если очередь полна, цепочка присоединяется
+// к последней в очереди: конец head находится по FAT в памяти, на диске
+// добавляется одна запись FAT.
+static void reclaim_push(int head) {
+    if (superblock.reclaim_count == RECLAIM_MAX) {
+        int tail = head;
+        int limit = superblock.total_blocks - DATA_START; // защита от зацикленной цепочки
+        for (int i = 0; i < limit && fat[tail] >= DATA_START && fat[tail] < superblock.total_blocks; i++) {
+            tail = fat[tail];
+        }
+        fat_set(tail, superblock.reclaim[RECLAIM_MAX - 1]);
+        superblock.reclaim_count--;
+    }
+    superblock.reclaim[superblock.reclaim_count++] = head;
+    meta_mark_dirty(0);
+}
+
+// Изменилась запись каталога с индексом index
+static void dir_mark_dirty(int index) {
+    if (index >= NUM_DIR_ENTRIES) {
+        // Блок продолжения таблицы: ищем в списке текущей транзакции
+        int k = (index - NUM_DIR_ENTRIES) / DIR_ENTRIES_PER_BLOCK;
+        for (int i = 0; i < dir_ext_dirty_count; i++) {
+            if (dir_ext_dirty[i] == k) {
+                return;
+            }
+        }
+        if (dir_ext_dirty_count < (int) JOURNAL_TX_MAX) {
+            dir_ext_dirty[dir_ext_dirty_count++] = k;
+        }
+        meta_dirty_count++; // переполнение транзакции не даст ее зафиксировать
+        return;
+    }
+    meta_mark_dirty(ROOT_DIR_START + index / DIR_ENTRIES_PER_BLOCK);
+}
+
+// Хеш имени файла (FNV-1a), никогда не равен 0
+static unsigned int name_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+// Запись каталога в формат диска (DIR_ENTRY_SIZE байт по адресу dst)
+static void dir_entry_encode(const DirectoryEntry *entry, char *dst) {
+    DiskDirEntry disk;
+    memset(&disk, 0, sizeof(disk));
+    if (entry->filename[0] != '\0') {
+        disk.name_hash = name_hash(entry->filename);
+        disk.version = DIR_ENTRY_VERSION;
+        disk.name_length = (uint8_t) strlen(entry->filename);
+        disk.type = (uint8_t) entry->type;
+        disk.size = entry->size;
+        disk.first_block = entry->first_block;
+        disk.parent = entry->parent;
+        memcpy(disk.filename, entry->filename, disk.name_length);
+        memcpy(disk.inline_data, entry->inline_data, INLINE_MAX);
+    }
+    memcpy(dst, &disk, DIR_ENTRY_SIZE);
+}
+
+// Запись каталога из формата диска. Возвращает 1 - файл, 0 - свободная
+// запись, -1 - запись испорчена (тогда она считается свободной).
+static int dir_entry_decode(DirectoryEntry *entry, const char *src) {
+    DiskDirEntry disk;
+    memcpy(&disk, src, DIR_ENTRY_SIZE);
+    memset(entry, 0, sizeof(DirectoryEntry));
+    entry->first_block = -1;
+    entry->parent = DIR_ROOT;
+    if (disk.version == 0) {
+        return 0;
+    }
+    if (disk.version != DIR_ENTRY_VERSION || disk.name_length == 0 ||
+        disk.name_length >= sizeof(disk.filename) || disk.size < 0 || disk.parent < DIR_ROOT ||
+        (disk.type != DIR_TYPE_FILE && disk.type != DIR_TYPE_DIR) ||
+        (disk.type == DIR_TYPE_DIR && (disk.size != 0 || disk.first_block != -1)) ||
+        memchr(disk.filename, '\0', sizeof(disk.filename)) != disk.filename + disk.name_length ||
+        disk.name_hash != name_hash(disk.filename)) {
+        return -1;
+    }
+    memcpy(entry->filename, disk.filename, sizeof(disk.filename));
+    entry->size = disk.size;
+    entry->first_block = disk.first_block;
+    entry->type = disk.type;
+    entry->parent = disk.parent;
+    memcpy(entry->inline_data, disk.inline_data, INLINE_MAX);
+    return 1;
+}
+
+// Кодируем блок таблицы записей, начинающийся с записи first:
+// DIR_ENTRIES_PER_BLOCK записей по DIR_ENTRY_SIZE байт
+static void dir_block_encode(int first, char *dst) {
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        dir_entry_encode(&directory_entries[first + i], dst + i * DIR_ENTRY_SIZE);
+    }
+}
+
+// Декодируем блок таблицы в entries[first..]; возвращает количество
+// испорченных записей
+static int dir_block_decode(DirectoryEntry *entries, int first, const char *src) {
+    int bad = 0;
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        if (dir_entry_decode(&entries[first + i], src + i * DIR_ENTRY_SIZE) == -1) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+// Поиск в корзине: бит i результата установлен, если keys[i] == key.
+// Вариант выбирается при первом вызове по возможностям процессора.
+static unsigned int dir_match_scalar(const uint32_t *keys, uint32_t key) {
+    unsigned int mask = 0;
+    for (int i = 0; i < DENTRY_BUCKET; i++) {
+        if (keys[i] == key) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static unsigned int dir_match_sse2(const uint32_t *keys, uint32_t key) {
+    __m128i k = _mm_set1_epi32((int) key);
+    __m128i lo = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *) keys), k);
+    __m128i hi = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *) (keys + 4)), k);
+    return (unsigned int) (_mm_movemask_ps(_mm_castsi128_ps(lo)) |
+                           (_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4));
+}
+
+__attribute__((target("avx2")))
+static unsigned int dir_match_avx2(const uint32_t *keys, uint32_t key) {
+    __m256i eq = _mm256_cmpeq_epi32(_mm256_load_si256((const __m256i *) keys), _mm256_set1_epi32((int) key));
+    return (unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+#endif
+
+static unsigned int dir_match_select(const uint32_t *keys, uint32_t key);
+static unsigned int (*dir_match)(const uint32_t *, uint32_t) = dir_match_select;
+
+static unsigned int dir_match_select(const uint32_t *keys, uint32_t key) {
+    dir_match = dir_match_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        dir_match = dir_match_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        dir_match = dir_match_sse2;
+    }
+#endif
+    return dir_match(keys, key);
+}
+
+// Ключ записи с именем name в каталоге parent; не бывает DENTRY_EMPTY/DELETED
+static uint32_t dentry_key(int parent, const char *name) {
+    uint32_t key = name_hash(name) ^ ((uint32_t) (parent + 1) * 2654435761u);
+    return key > DENTRY_DELETED ? key : key + 2;
+}
+
+// Индекс записи с именем name в каталоге parent, -1 - такой нет
+static int dentry_find(int parent, const char *name) {
+    if (dentry_table == NULL) {
+        return -1; // Диск не отформатирован
+    }
+    uint32_t key = dentry_key(parent, name);
+    for (int probe = 0, b = (int) key & dentry_mask; probe <= dentry_mask; probe++, b = (b + 1) & dentry_mask) {
+        DentryBucket *bucket = &dentry_table[b];
+        unsigned int mask = dir_match(bucket->keys, key);
+        while (mask != 0) {
+            DirectoryEntry *entry = &directory_entries[bucket->slots[__builtin_ctz(mask)]];
+            if (entry->parent == parent && strcmp(entry->filename, name) == 0) {
+                return bucket->slots[__builtin_ctz(mask)];
+            }
+            mask &= mask - 1;
+        }
+        if (dir_match(bucket->keys, DENTRY_EMPTY) != 0) {
+            break; // дальше ключ не мог уйти
+        }
+    }
+    return -1;
+}
+
+static void dentry_add(int slot) {
+    DirectoryEntry *entry = &directory_entries[slot];
+    uint32_t key = dentry_key(entry->parent, entry->filename);
+    for (int b = (int) key & dentry_mask; ; b = (b + 1) & dentry_mask) {
+        DentryBucket *bucket = &dentry_table[b];
+        unsigned int mask = dir_match(bucket->keys, DENTRY_EMPTY) | dir_match(bucket->keys, DENTRY_DELETED);
+        if (mask != 0) {
+            int i = __builtin_ctz(mask);
+            if (bucket->keys[i] == DENTRY_EMPTY) {
+                dentry_used++;
+            }
+            bucket->keys[i] = key;
+            bucket->slots[i] = slot;
+            return;
+        }
+    }
+}
+
+static void dentry_remove(int slot) {
+    DirectoryEntry *entry = &directory_entries[slot];
+    uint32_t key = dentry_key(entry->parent, entry->filename);
+    for (int b = (int) key & dentry_mask; ; b = (b + 1) & dentry_mask) {
+        DentryBucket *bucket = &dentry_table[b];
+        unsigned int mask = dir_match(bucket->keys, key);
+        while (mask != 0) {
+            int i = __builtin_ctz(mask);
+            if (bucket->slots[i] == slot) {
+                bucket->keys[i] = DENTRY_DELETED;
+                return;
+            }
+            mask &= mask - 1;
+        }
+    }
+}
+
+// Строим индекс заново (при монтировании и когда он заполнится):
+// корзин столько, чтобы занятой была не больше половины мест
+static int dentry_build() {
+    int buckets = 16;
+    while (buckets * DENTRY_BUCKET < 2 * dir_slots) {
+        buckets *= 2;
+    }
+    DentryBucket *table;
+    if (posix_memalign((void **) &table, sizeof(DentryBucket), (size_t) buckets * sizeof(DentryBucket)) != 0) {
+        return -1;
+    }
+    memset(table, 0, (size_t) buckets * sizeof(DentryBucket));
+    free(dentry_table);
+    dentry_table = table;
+    dentry_mask = buckets - 1;
+    dentry_used = 0;
+    for (int i = 0; i < dir_slots; i++) {
+        if (directory_entries[i].filename[0] != '\0') {
+            dentry_add(i);
+        }
+    }
+    return 0;
+}
+
+// Записей в каталоге dir (DIR_ROOT - корень)
+static int *dir_children(int dir) {
+    return (dir == DIR_ROOT) ? &root_children : &directory_entries[dir].children;
+}
+
+// Разбор пути: "/a/b/name" или "a/b/name" (от корня). В *parent -
+// каталог последнего компонента, в name - сам компонент. Возвращает 0
+// или -1, если промежуточного каталога нет или путь неправильный.
+static int path_resolve(const char *path, int *parent, char *name) {
+    int dir = DIR_ROOT;
+    if (path == NULL) {
+        return -1;
+    }
+    while (*path == '/') {
+        path++;
+    }
+    while (1) {
+        const char *end = strchr(path, '/');
+        size_t length = (end != NULL) ? (size_t) (end - path) : strlen(path);
+        if (length == 0 || length >= sizeof(directory_entries[0].filename)) {
+            return -1; // пустое или слишком длинное имя
+        }
+        memcpy(name, path, length);
+        name[length] = '\0';
+        while (end != NULL && *end == '/') {
+            end++;
+        }
+        if (end == NULL || *end == '\0') {
+            *parent = dir;
+            return 0;
+        }
+        int next = dentry_find(dir, name);
+        if (next == -1 || directory_entries[next].type != DIR_TYPE_DIR) {
+            return -1; // нет такого каталога
+        }
+        dir = next;
+        path = end;
+    }
+}
+
+// Индекс записи по пути, -1 - такой нет
+static int path_lookup(const char *path) {
+    char name[32];
+    int parent;
+    if (path_resolve(path, &parent, name) == -1) {
+        return -1;
+    }
+    return dentry_find(parent, name);
+}
+
+// Меняем размер таблицы записей; новые записи свободны
+static int dir_table_resize(int slots) {
+    int ext = (slots - NUM_DIR_ENTRIES) / DIR_ENTRIES_PER_BLOCK;
+    DirectoryEntry *entries = realloc(directory_entries, (size_t) slots * sizeof(DirectoryEntry));
+    if (entries == NULL) {
+        return -1;
+    }
+    directory_entries = entries;
+    int *blocks = realloc(dir_ext_blocks, (size_t) (ext + 1) * sizeof(int));
+    if (blocks == NULL) {
+        return -1;
+    }
+    dir_ext_blocks = blocks;
+    for (int i = dir_slots; i < slots; i++) {
+        memset(&directory_entries[i], 0, sizeof(DirectoryEntry));
+        directory_entries[i].first_block = -1;
+        directory_entries[i].parent = DIR_ROOT;
+    }
+    dir_slots = slots;
+    return 0;
+}
+
+// Загружаем таблицу записей: блоки корневого каталога, затем цепочку
+// продолжения. Возвращает количество пропущенных испорченных записей
+// или -1 при ошибке чтения.
+static int dir_table_load() {
+    int ext = 0;
+    int limit = superblock.total_blocks - DATA_START; // защита от зацикленной цепочки
+    for (int b = superblock.dir_ext; b >= DATA_START && b < superblock.total_blocks && ext < limit; b = fat[b]) {
+        ext++;
+    }
+    if (dir_table_resize(NUM_DIR_ENTRIES + ext * DIR_ENTRIES_PER_BLOCK) == -1) {
+        return -1;
+    }
+
+    int bad = 0;
+    char *block;
+    for (int b = 0; b < ROOT_DIR_BLOCKS; b++) {
+        if ((block = cache_block(ROOT_DIR_START + b)) == NULL) {
+            return -1;
+        }
+        bad += dir_block_decode(directory_entries, b * DIR_ENTRIES_PER_BLOCK, block);
+    }
+    int b = superblock.dir_ext;
+    for (int k = 0; k < ext; k++, b = fat[b]) {
+        if ((block = cache_block(b)) == NULL) {
+            return -1;
+        }
+        dir_ext_blocks[k] = b;
+        bad += dir_block_decode(directory_entries, NUM_DIR_ENTRIES + k * DIR_ENTRIES_PER_BLOCK, block);
+    }
+
+    // Запись, родитель которой не каталог, по пути не найти: пропускаем
+    // ее (а с ней и то, что было в ней, если это каталог)
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int i = 0; i < dir_slots; i++) {
+            DirectoryEntry *entry = &directory_entries[i];
+            int parent = entry->parent;
+            if (entry->filename[0] == '\0' || parent == DIR_ROOT) {
+                continue;
+            }
+            if (parent >= dir_slots || directory_entries[parent].filename[0] == '\0' ||
+                directory_entries[parent].type != DIR_TYPE_DIR) {
+                memset(entry, 0, sizeof(DirectoryEntry));
+                entry->first_block = -1;
+                entry->parent = DIR_ROOT;
+                bad++;
+                changed = 1;
+            }
+        }
+    }
+
+    files_count = 0;
+    for (int i = 0; i < dir_slots; i++) {
+        if (directory_entries[i].filename[0] != '\0') {
+            (*dir_children(directory_entries[i].parent))++;
+            files_count++;
+        }
+    }
+    if (dentry_build() == -1) {
+        return -1;
+    }
+    return bad;
+}
+
+// Свободных записей нет: добавляем к таблице блок продолжения. Его
+// образ с пустыми записями попадет на диск через журнал.
+static int dir_table_grow() {
+    int block = find_free_block();
+    if (block == -1) {
+        return -1; // Диск заполнен
+    }
+    int k = (dir_slots - NUM_DIR_ENTRIES) / DIR_ENTRIES_PER_BLOCK;
+    if (dir_table_resize(dir_slots + DIR_ENTRIES_PER_BLOCK) == -1) {
+        return -1;
+    }
+    free_map[block / 64] &= ~(1ULL << (block % 64));
+    fat_set(block, FAT_EOC);
+    if (k == 0) {
+        superblock.dir_ext = block;
+    } else {
+        fat_set(dir_ext_blocks[k - 1], block);
+    }
+    dir_ext_blocks[k] = block;
+    superblock.free_blocks--;
+    meta_mark_dirty(0);
+    STAT_ADD(fat_allocs, 1);
+    dir_mark_dirty(NUM_DIR_ENTRIES + k * DIR_ENTRIES_PER_BLOCK);
+    return 0;
+}
+
+// Таблица записей и индекс больше не нужны (размонтирование)
+static void dir_table_free() {
+    free(directory_entries);
+    free(dir_ext_blocks);
+    free(dentry_table);
+    directory_entries = NULL;
+    dir_ext_blocks = NULL;
+    dentry_table = NULL;
+    dir_slots = 0;
+    dentry_mask = 0;
+    dentry_used = 0;
+    dir_ext_dirty_count = 0;
+    root_children = 0;
+    dir_free_hint = 0;
+}
+
+// Образ блока метаданных block по состоянию в памяти
+static void meta_block_image(int block, char *dst) {
+    if (block == 0) {
+        memset(dst, 0, BLOCKSIZE);
+        memcpy(dst, &superblock, SUPERBLOCK_SIZE);
+    } else if (block < FAT_START) {
+        dir_block_encode((block - ROOT_DIR_START) * DIR_ENTRIES_PER_BLOCK, dst);
+    } else {
+        memcpy(dst, (char *) fat + (size_t) (block - FAT_START) * BLOCKSIZE, BLOCKSIZE);
+    }
+}
+
+// Контрольная сумма (FNV-1a) образов блоков транзакции
+static unsigned int journal_checksum(const char *data, size_t len) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Записываем заголовок журнала: журнал пуст, следующая транзакция - sequence
+static int journal_write_header(int sequence) {
+    JournalHeader *header = block_buf_get();
+    if (header == NULL) {
+        return -1;
+    }
+    memset(header, 0, BLOCKSIZE);
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = sequence;
+    int ret = write_block(header, JOURNAL_START);
+    block_buf_put(header);
+    return ret;
+}
+
+// Контрольная точка: все зафиксированные транзакции уже записаны на свои
+// места, после fsync журнал можно начинать сначала
+static int journal_checkpoint() {
+    if (fsync(vdisk_fd) == -1) {
+        return -1;
+    }
+    if (journal_write_header(journal_sequence) == -1 || fsync(vdisk_fd) == -1) {
+        return -1;
+    }
+    journal_used = 0;
+    return 0;
+}
+
+// Пишем образы транзакции из journal_buf на свои места:
+// непрерывная серия блоков - одна запись
+static int journal_write_home(JournalDescriptor *descriptor) {
+    int i = 0;
+    while (i < descriptor->count) {
+        int j = i + 1;
+        while (j < descriptor->count && descriptor->blocks[j] == descriptor->blocks[i] + (j - i)) {
+            j++;
+        }
+        if (write_blocks(journal_buf + (size_t) (i + 1) * BLOCKSIZE, descriptor->blocks[i], j - i) == -1) {
+            return -1;
+        }
+        i = j;
+    }
+    return 0;
+}
+
+// Фиксация текущей транзакции (групповая фиксация): образы всех измененных
+// блоков метаданных пишутся в журнал одной последовательной записью вместе
+// с дескриптором и блоком фиксации, затем один fsync. Он же делает
+// надежными и блоки данных, записанные до фиксации. После этого образы
+// пишутся на свои места без fsync - до следующей контрольной точки их
+// восстановит журнал.
+int journal_commit() {
+    if (meta_dirty_count == 0) {
+        return fsync(vdisk_fd);
+    }
+    if (meta_dirty_count > (int) JOURNAL_TX_MAX) {
+        return -1; // Шаг операции не уложился в транзакцию
+    }
+    if (journal_used + meta_dirty_count + 2 > JOURNAL_LOG_BLOCKS && journal_checkpoint() == -1) {
+        return -1;
+    }
+
+    JournalDescriptor *descriptor = (JournalDescriptor *) journal_buf;
+    memset(descriptor, 0, BLOCKSIZE);
+    descriptor->magic = JOURNAL_MAGIC;
+    descriptor->type = JOURNAL_DESCRIPTOR;
+    descriptor->sequence = journal_sequence;
+    for (int block = 0; block < JOURNAL_START; block++) {
+        if (meta_dirty[block]) {
+            meta_block_image(block, journal_buf + (size_t) (descriptor->count + 1) * BLOCKSIZE);
+            descriptor->blocks[descriptor->count++] = block;
+        }
+    }
+    for (int i = 0; i < dir_ext_dirty_count; i++) {
+        int k = dir_ext_dirty[i];
+        dir_block_encode(NUM_DIR_ENTRIES + k * DIR_ENTRIES_PER_BLOCK,
+                         journal_buf + (size_t) (descriptor->count + 1) * BLOCKSIZE);
+        descriptor->blocks[descriptor->count++] = dir_ext_blocks[k];
+    }
+    int count = descriptor->count;
+
+    JournalCommit *commit = (JournalCommit *) (journal_buf + (size_t) (count + 1) * BLOCKSIZE);
+    memset(commit, 0, BLOCKSIZE);
+    commit->magic = JOURNAL_MAGIC;
+    commit->type = JOURNAL_COMMIT;
+    commit->sequence = journal_sequence;
+    commit->checksum = journal_checksum(journal_buf, (size_t) (count + 1) * BLOCKSIZE);
+
+    // Пока транзакция не на диске, ее блоки остаются измененными: неудачная
+    // фиксация повторится со следующей
+    if (write_blocks(journal_buf, JOURNAL_LOG_START + journal_used, count + 2) == -1 || fsync(vdisk_fd) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (descriptor->blocks[i] < JOURNAL_START) {
+            meta_dirty[descriptor->blocks[i]] = 0;
+        }
+    }
+    meta_dirty_count = 0;
+    dir_ext_dirty_count = 0;
+    journal_used += count + 2;
+    journal_sequence++;
+    STAT_ADD(journal_commits, 1);
+    map_release_pending();
+
+    if (journal_write_home(descriptor) == -1) {
+        return -1;
+    }
+    if (journal_used >= JOURNAL_CHECKPOINT_BLOCKS) {
+        return journal_checkpoint();
+    }
+    return 0;
+}
+
+// Восстановление после сбоя: повторяем зафиксированные транзакции журнала,
+// начиная с той, что указана в заголовке. Транзакция без верного блока
+// фиксации (запись прервалась) и все следующие за ней отбрасываются.
+// Контрольные точки не дают журналу вырасти больше
+// JOURNAL_CHECKPOINT_BLOCKS + JOURNAL_TX_MAX + 2 блоков, поэтому время
+// восстановления не зависит от размера диска. Каталог и FAT не сканируются.
+static int journal_recover() {
+    JournalHeader *header = block_buf_get();
+    int replayed = 0;
+
+    if (header == NULL || read_block(header, JOURNAL_START) == -1 || header->magic != JOURNAL_MAGIC) {
+        block_buf_put(header);
+        return -1;
+    }
+    journal_sequence = header->sequence;
+    journal_used = 0;
+    block_buf_put(header);
+
+    JournalDescriptor *descriptor = (JournalDescriptor *) journal_buf;
+    while (journal_used + 2 <= JOURNAL_LOG_BLOCKS) {
+        if (read_block(descriptor, JOURNAL_LOG_START + journal_used) == -1 ||
+            descriptor->magic != JOURNAL_MAGIC || descriptor->type != JOURNAL_DESCRIPTOR ||
+            descriptor->sequence != journal_sequence ||
+            descriptor->count <= 0 || descriptor->count > (int) JOURNAL_TX_MAX ||
+            journal_used + descriptor->count + 2 > JOURNAL_LOG_BLOCKS) {
+            break;
+        }
+
+        // Образы и блок фиксации лежат подряд - читаем их одним запросом
+        int count = descriptor->count;
+        if (read_blocks(journal_buf + BLOCKSIZE, JOURNAL_LOG_START + journal_used + 1, count + 1) == -1) {
+            break;
+        }
+        JournalCommit *commit = (JournalCommit *) (journal_buf + (size_t) (count + 1) * BLOCKSIZE);
+        if (commit->magic != JOURNAL_MAGIC || commit->type != JOURNAL_COMMIT ||
+            commit->sequence != journal_sequence ||
+            commit->checksum != journal_checksum(journal_buf, (size_t) (count + 1) * BLOCKSIZE)) {
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int block = descriptor->blocks[i];
+            if (block < 0 || (block >= JOURNAL_START && block < DATA_START) || block >= superblock.total_blocks) {
+                return -1; // Блок вне метаданных и таблицы каталога - журнал не наш
+            }
+        }
+        if (journal_write_home(descriptor) == -1) {
+            return -1;
+        }
+        journal_used += count + 2;
+        journal_sequence++;
+        replayed++;
+    }
+
+    // Библиотека не пишет в stdout программы: количество - в статистике
+    STAT_ADD(journal_replays, replayed);
+    fprintf(stderr, "journal: unclean shutdown, replayed %d transactions (%d blocks)\n", replayed, journal_used);
+    // Все найденные транзакции на своих местах - журнал снова пуст
+    return journal_checkpoint();
+}
+
+// Корректное монтирование: журнал пуст, нужен только номер транзакции
+static int journal_open() {
+    JournalHeader *header = block_buf_get();
+    if (header == NULL || read_block(header, JOURNAL_START) == -1 || header->magic != JOURNAL_MAGIC) {
+        block_buf_put(header);
+        return -1;
+    }
+    journal_sequence = header->sequence;
+    journal_used = 0;
+    block_buf_put(header);
+    return 0;
+}
+
+// Диск смонтирован: флаг clean сбрасывается с первой транзакцией.
+// До нее на диске ничего не меняется, и он остается чистым.
+static void superblock_mark_in_use() {
+    superblock.clean = 0;
+    meta_mark_dirty(0);
+}
+
+// Операция завершена; с MOUNT_SYNC она сразу фиксируется
+static int journal_op_done() {
+    if (mount_flags & MOUNT_SYNC) {
+        return journal_commit();
+    }
+    return 0;
+}
+
+
+/**********************************************************************
+   The following functions are to be called by applications directly.
+***********************************************************************/
+
+// В функции sfs_format
+int sfs_format(char *vdiskname) {
+    return sfs_format_inline(vdiskname, INLINE_MAX);
+}
+
+static int volume_format(int inline_max) {
+    struct stat st;
+    char *metadata;
+
+    trace_call = SFS_CALL_FORMAT;
+
+    if (inline_max < 0 || inline_max > INLINE_MAX) {
+        return -1; // Ошибка: столько данных в запись каталога не поместится
+    }
+    if (fstat(vdisk_fd, &st) == -1) {
+        perror("Error reading virtual disk size");
+        return -1;
+    }
+    snapshot_free_all(); // их блоки будут затерты
+
+    // Заполнить суперблок информацией: блоки данных занимают весь диск,
+    // насколько хватает FAT; размер кратен строке ввода-вывода. Суперблок
+    // смонтированного диска обнуляется целиком, иначе очередь отложенного
+    // освобождения освободила бы блоки новой файловой системы
+    memset(&superblock, 0, sizeof(superblock));
+    int total_blocks = (int) (st.st_size / BLOCKSIZE);
+    total_blocks -= total_blocks % CACHE_LINE_BLOCKS;
+    if (total_blocks > FAT_ENTRIES) {
+        total_blocks = FAT_ENTRIES;
+    }
+    if (total_blocks <= DATA_START) {
+        fprintf(stderr, "Error: virtual disk is too small\n");
+        return -1;
+    }
+    superblock.total_blocks = total_blocks;
+    superblock.free_blocks = total_blocks - DATA_START; // все блоки данных свободны в начале
+    superblock.fat_blocks = FAT_SIZE; // фиксированное количество блоков для FAT
+    superblock.root_dir_blocks = ROOT_DIR_BLOCKS; // фиксированное количество блоков для корневого каталога
+    superblock.journal_blocks = JOURNAL_BLOCKS; // журнал метаданных после FAT
+    superblock.clean = 1;
+    superblock.inline_max = inline_max; // порог хранения данных в записи каталога
+    superblock.dir_ext = -1; // вся таблица записей пока в блоках корневого каталога
+
+    // Суперблок, пустой корневой каталог, обнуленная FAT и пустой журнал
+    // пишутся одним пакетом
+    if (posix_memalign((void **) &metadata, DIRECT_IO_ALIGN, (size_t) DATA_START * BLOCKSIZE) != 0) {
+        return -1; // Ошибка выделения памяти
+    }
+    memset(metadata, 0, (size_t) DATA_START * BLOCKSIZE);
+    memcpy(metadata, &superblock, SUPERBLOCK_SIZE);
+    JournalHeader *header = (JournalHeader *) (metadata + (size_t) JOURNAL_START * BLOCKSIZE);
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = 1;
+    int ret = write_blocks(metadata, 0, DATA_START);
+    free(metadata);
+    if (ret == -1) {
+        return -1; // Ошибка записи
+    }
+    // Старые данные больше не нужны: возвращаем хосту всю область данных
+    if (mount_flags & MOUNT_PUNCH_HOLES) {
+        punch_hole(DATA_START, total_blocks - DATA_START);
+    }
+    if (fsync(vdisk_fd) == -1) {
+        return -1; // Ошибка записи
+    }
+
+    // Диск смонтирован: приводим состояние в памяти к пустой файловой системе
+    memset(fat, 0, sizeof(fat));
+    memset(meta_dirty, 0, sizeof(meta_dirty));
+    meta_dirty_count = 0;
+    journal_sequence = 1;
+    journal_used = 0;
+    dir_table_free();
+    if (dir_table_resize(NUM_DIR_ENTRIES) == -1 || dentry_build() == -1) {
+        return -1; // Ошибка выделения памяти
+    }
+    files_count = 0;
+    alloc_hint = DATA_START;
+    defrag_file = -1;
+    defrag_next = 0;
+    map_build();
+    init_open_files();
+    superblock_mark_in_use();
+
+    return 0; // Успешное форматирование
+}
+
+int sfs_format_inline(char *vdiskname, int inline_max) {
+    long long start = stats_clock();
+    (void) vdiskname; // форматируется смонтированный диск
+    int ret = volume_format(inline_max);
+    record_call(start, ret, "format %d", inline_max);
+    return ret;
+}
+
+// Монтирование не удалось: закрываем диск и освобождаем буферы
+static int mount_fail() {
+    close(vdisk_fd);
+    io_buffers_free();
+    dir_table_free();
+    memset(&superblock, 0, SUPERBLOCK_SIZE);
+    return -1;
+}
+
+int sfs_mount_flags(char *vdiskname, int flags) {
+    trace_call = SFS_CALL_MOUNT;
+    // Проверка имени диска
+    if (vdiskname == NULL) {
+        fprintf(stderr, "Error: Disk name is NULL\n");
+        return -1; // Ошибка: имя диска не может быть NULL
+    }
+
+    // Открыть виртуальный диск с разрешениями чтения и записи
+    // (с MOUNT_DIRECT - в обход страничного кэша хоста)
+    vdisk_fd = open(vdiskname, (flags & MOUNT_DIRECT) ? O_RDWR | O_DIRECT : O_RDWR);
+    if (vdisk_fd < 0) {
+        perror("Error opening virtual disk");
+        return -1; // Ошибка: не удалось открыть файл
+    }
+    mount_flags = flags;
+
+    if (io_buffers_init() == -1) {
+        fprintf(stderr, "Error: cannot allocate I/O buffers\n");
+        return mount_fail();
+    }
+
+    init_open_files(); // Инициализируем таблицу открытых файлов(Фикс)
+    memset(meta_dirty, 0, sizeof(meta_dirty));
+    meta_dirty_count = 0;
+    dir_table_free();
+    files_count = 0;
+    alloc_hint = DATA_START;
+    defrag_file = -1;
+    defrag_next = 0;
+
+    // Читаем суперблок; неотформатированный диск монтируется пустым,
+    // чтобы его можно было отформатировать через sfs_format
+    char *block = cache_block(0); // суперблок читаем прямо из строки кэша
+    if (block == NULL) {
+        return mount_fail();
+    }
+    memcpy(&superblock, block, SUPERBLOCK_SIZE);
+    if (superblock.total_blocks <= DATA_START || superblock.total_blocks > FAT_ENTRIES ||
+        superblock.journal_blocks != JOURNAL_BLOCKS ||
+        superblock.inline_max < 0 || superblock.inline_max > INLINE_MAX ||
+        (superblock.dir_ext != -1 && (superblock.dir_ext < DATA_START || superblock.dir_ext >= superblock.total_blocks))) {
+        memset(&superblock, 0, SUPERBLOCK_SIZE);
+        memset(fat, 0, sizeof(fat));
+        return 0;
+    }
+
+    // После корректного размонтирования журнал пуст. Иначе доводим
+    // метаданные до последней зафиксированной транзакции, повторяя только
+    // хвост журнала после контрольной точки, и перечитываем суперблок.
+    if (superblock.clean) {
+        if (journal_open() == -1) {
+            fprintf(stderr, "Error: cannot open the journal\n");
+            return mount_fail();
+        }
+    } else {
+        if (journal_recover() == -1 || (block = cache_block(0)) == NULL) {
+            fprintf(stderr, "Error: cannot recover the journal\n");
+            return mount_fail();
+        }
+        memcpy(&superblock, block, SUPERBLOCK_SIZE);
+    }
+    if (read_blocks(fat, FAT_START, FAT_SIZE) == -1) {
+        return mount_fail();
+    }
+    map_build();
+    int bad_entries = dir_table_load();
+    if (bad_entries == -1) {
+        return mount_fail();
+    }
+    if (bad_entries > 0) {
+        fprintf(stderr, "Warning: %d corrupted directory entries skipped, run sfs_fsck\n", bad_entries);
+    }
+    superblock_mark_in_use();
+
+    // Успешное открытие диска
+    return 0;
+}
+
+int sfs_mount(char *vdiskname) {
+    return sfs_mount_flags(vdiskname, 0);
+}
+
+int sfs_sync() {
+    long long start = stats_start(SFS_OP_SYNC);
+    reclaim_step(RECLAIM_BATCH);
+    int ret = journal_commit();
+    stats_time(SFS_OP_SYNC, start);
+    record_call(start, ret, "sync");
+    return ret;
+}
+
+int sfs_umount ()
+{
+    int stats = mount_flags & MOUNT_STATS;
+    int ret = 0;
+    trace_call = SFS_CALL_UMOUNT;
+    snapshot_free_all();
+    if (superblock.total_blocks > 0) {
+        // Фиксируем последнюю транзакцию, оставляем журнал пустым
+        // и только после этого отмечаем диск как чистый. Если что-то
+        // не записалось, диск остается нечистым: при следующем
+        // монтировании его восстановит журнал.
+        ret = journal_commit();
+        if (ret == 0) {
+            ret = journal_checkpoint();
+        }
+        if (ret == 0) {
+            superblock.clean = 1;
+            char *block = block_buf_get();
+            ret = -1;
+            if (block != NULL) {
+                meta_block_image(0, block);
+                ret = write_block(block, 0);
+                block_buf_put(block);
+            }
+        }
+    }
+    if (fsync (vdisk_fd) == -1) {
+        ret = -1;
+    }
+    if (close (vdisk_fd) == -1) {
+        ret = -1;
+    }
+    io_buffers_free();
+    dir_table_free();
+    if (stats) {
+        stats_dump();
+    }
+    return ret;
+}
+
+// Создание записи типа type по пути path (общая часть sfs_create и sfs_mkdir)
+static int dir_entry_create(char *path, int type) {
+    char name[32];
+    int parent;
+
+    // Проверка пути: все каталоги до последнего компонента должны быть
+    if (superblock.total_blocks == 0 || path_resolve(path, &parent, name) == -1) {
+        return -1; // Ошибка: диск не отформатирован или пути нет
+    }
+    if (dentry_find(parent, name) != -1) {
+        return -1; // Ошибка: такое имя в каталоге уже есть
+    }
+    if (journal_reserve(JOURNAL_OP_BLOCKS) == -1) {
+        return -1; // Ошибка записи в диск
+    }
+
+    // Поиск первого доступного места в таблице записей; если его нет,
+    // таблица растет на блок
+    int entry_index = -1;
+    for (int i = dir_free_hint; i < dir_slots; i++) {
+        if (directory_entries[i].filename[0] == '\0') { // Найдено свободное место
+            entry_index = i;
+            break;
+        }
+    }
+    if (entry_index == -1) {
+        if (dir_table_grow() == -1) {
+            return -1; // Ошибка: нет места для записи каталога
+        }
+        entry_index = dir_slots - DIR_ENTRIES_PER_BLOCK;
+    }
+    dir_free_hint = entry_index + 1;
+    if ((dentry_used + 1) * 4 > (dentry_mask + 1) * DENTRY_BUCKET * 3 && dentry_build() == -1) {
+        return -1; // Ошибка выделения памяти
+    }
+
+    // Создание записи
+    DirectoryEntry *entry = &directory_entries[entry_index];
+    memset(entry, 0, sizeof(DirectoryEntry));
+    strcpy(entry->filename, name);
+    entry->size = 0; // Новый файл пока пустой
+    entry->first_block = -1; // Блоков данных пока нет
+    entry->type = type;
+    entry->parent = parent;
+    dentry_add(entry_index);
+    (*dir_children(parent))++;
+
+    files_count++; // Увеличение счетчика файлов
+
+    // Блок каталога попадет на диск с транзакцией журнала
+    dir_mark_dirty(entry_index);
+    if (journal_op_done() == -1) {
+        return -1; // Ошибка записи в диск
+    }
+
+    return 0; // Успешное создание
+}
+
+int sfs_create(char *filename) {
+    long long start = stats_start(SFS_OP_CREATE);
+    int ret = dir_entry_create(filename, DIR_TYPE_FILE);
+    stats_time(SFS_OP_CREATE, start);
+    record_named(start, ret, "create", filename, "");
+    return ret;
+}
+
+int sfs_mkdir(char *dirname) {
+    long long start = stats_start(SFS_OP_CREATE);
+    int ret = dir_entry_create(dirname, DIR_TYPE_DIR);
+    stats_time(SFS_OP_CREATE, start);
+    record_named(start, ret, "mkdir", dirname, "");
+    return ret;
+}
+
+
+static int file_open(char *filename, int mode) {
+    // Проверка имени файла
+    if (filename == NULL) {
+        return -1; // Ошибка: имя файла не может быть NULL
+    }
+
+    // Поиск файла по пути
+    int i = path_lookup(filename);
+    if (i == -1 || directory_entries[i].type != DIR_TYPE_FILE) {
+        return -1; // Ошибка: файл не найден
+    }
+
+    // Проверка наличия места в таблице открытых файлов
+    for (int j = 0; j < MAX_OPEN_FILES; j++) {
+        if (open_files[j].fd == -1) { // Свободная запись
+            // Заполнение структуры OpenFileEntry
+            open_files[j].fd = j; // Для простоты используем индекс как fd
+            strcpy(open_files[j].filename, directory_entries[i].filename);
+            open_files[j].mode = mode;
+            open_files[j].current_size = directory_entries[i].size; // Получаем размер файла
+            open_files[j].dir_index = i;
+            open_files[j].position = 0; // Чтение начинается с начала файла
+            open_files[j].cur_block = -1;
+            open_files[j].cur_index = 0;
+            open_files[j].last_block = -1;
+            open_files[j].reserve_count = 0;
+
+            // Возвращаем индекс как дескриптор файла
+            return j;
+        }
+    }
+    return -1; // Ошибка: нет места для открытия файла
+}
+
+int sfs_open(char *filename, int mode) {
+    long long start = stats_start(SFS_OP_OPEN);
+    int ret = file_open(filename, mode);
+    stats_time(SFS_OP_OPEN, start);
+    record_named(start, ret, "open", filename, " %d", mode);
+    return ret;
+}
+
+static int file_close(int fd) {
+    // Проверка допустимости дескриптора файла
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -1; // Ошибка: недопустимый дескриптор
+    }
+
+    // Проверка, открыт ли файл
+    if (open_files[fd].fd == -1) {
+        return -1; // Ошибка: файл не открыт
+    }
+
+    // Неиспользованное окно дескриптора снова можно выделять
+    file_release(&open_files[fd]);
+
+    // Освобождаем запись в таблице открытых файлов
+    open_files[fd].fd = -1; // Устанавливаем в -1, чтобы отметить запись как свободную
+    memset(open_files[fd].filename, 0, sizeof(open_files[fd].filename)); // Очистим имя файла
+    open_files[fd].mode = 0; // Очистить режим
+    open_files[fd].current_size = 0; // Очистить текущий размер
+
+    return 0; // Успешное закрытие файла
+}
+
+int sfs_close(int fd) {
+    long long start = stats_start(SFS_OP_CLOSE);
+    int ret = file_close(fd);
+    stats_time(SFS_OP_CLOSE, start);
+    record_call(start, ret, "close %d", fd);
+    return ret;
+}
+
+
+int sfs_getsize(int fd) {
+    // Проверка диапазона дескриптора файла
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -1; // Ошибка: недопустимый дескриптор
+    }
+
+    // Проверка, что запись в таблице открытых файлов существует
+    if (open_files[fd].fd == -1) {
+        return -1; // Ошибка: файл не открыт
+    }
+
+    // Размер берем из записи каталога, запомненной при открытии
+    return directory_entries[open_files[fd].dir_index].size;
+}
+
+
+static int file_read(int fd, void *buf, int n) {
+    // Проверка допустимости дескриптора файла
+    if (fd < 0 || fd >= MAX_OPEN_FILES || n < 0) {
+        return -1; // Ошибка: недопустимый дескриптор
+    }
+
+    // Проверка, открыт ли файл на чтение
+    if (open_files[fd].fd == -1 || open_files[fd].mode != MODE_READ) {
+        return -1; // Ошибка: файл не открыт
+    }
+
+    OpenFileEntry *file = &open_files[fd];
+    DirectoryEntry *entry = &directory_entries[file->dir_index];
+
+    // Определяем количество байт, которые нужно прочитать с текущей позиции
+    int remaining = entry->size - file->position;
+    if (remaining <= 0) {
+        return 0; // Достигнут конец файла
+    }
+    int bytes_to_read = (n > remaining) ? remaining : n;
+    int total_read = 0; // Общее количество прочитанных байтов
+
+    // Маленький файл читаем прямо из записи каталога
+    if (entry->first_block == -1) {
+        memcpy(buf, entry->inline_data + file->position, bytes_to_read);
+        file->position += bytes_to_read;
+        return bytes_to_read;
+    }
+
+    // Находим блок, содержащий позицию чтения. При последовательном чтении
+    // он уже запомнен, иначе проходим цепочку FAT в памяти от начала файла.
+    int index = file->position / BLOCKSIZE;
+    if (file->cur_block == -1 || file->cur_index > index) {
+        file->cur_block = entry->first_block;
+        file->cur_index = 0;
+    }
+    while (file->cur_index < index) {
+        file->cur_block = fat[file->cur_block];
+        file->cur_index++;
+    }
+
+    while (total_read < bytes_to_read) {
+        int offset = file->position % BLOCKSIZE;
+        int left = bytes_to_read - total_read;
+
+        if (offset == 0 && left >= BLOCKSIZE) {
+            // Целые блоки: серию подряд лежащих блоков читаем сразу в buf
+            int run = 1;
+            while (run < left / BLOCKSIZE && fat[file->cur_block + run - 1] == file->cur_block + run) {
+                run++;
+            }
+            if (read_blocks((char *) buf + total_read, file->cur_block, run) == -1) {
+                return -1; // Ошибка чтения блоков
+            }
+            total_read += run * BLOCKSIZE;
+            file->position += run * BLOCKSIZE;
+            file->cur_block = fat[file->cur_block + run - 1];
+            file->cur_index += run;
+            continue;
+        }
+
+        // Неполный блок копируем прямо из строки кэша
+        char *block = cache_block(file->cur_block);
+        if (block == NULL) {
+            return -1; // Ошибка чтения блока
+        }
+
+        // Определяем сколько байтов копировать из блока
+        int bytes_in_block = BLOCKSIZE - offset;
+        if (bytes_in_block > bytes_to_read - total_read) {
+            bytes_in_block = bytes_to_read - total_read;
+        }
+
+        // Копируем данные в буфер
+        memcpy((char *) buf + total_read, block + offset, bytes_in_block);
+        total_read += bytes_in_block;
+        file->position += bytes_in_block;
+
+        // Блок прочитан до конца - переходим к следующему по FAT
+        if (file->position % BLOCKSIZE == 0) {
+            file->cur_block = fat[file->cur_block];
+            file->cur_index++;
+        }
+    }
+
+    return total_read; // Возвращаем количество успешно прочитанных байтов
+}
+
+int sfs_read(int fd, void *buf, int n) {
+    long long start = stats_start(SFS_OP_READ);
+    int ret = file_read(fd, buf, n);
+    stats_time(SFS_OP_READ, start);
+    record_call(start, ret, "read %d %d", fd, n);
+    if (ret > 0) {
+        STAT_ADD(bytes_read, ret);
+    }
+    return ret;
+}
+
+
+int find_free_block() {
+    // Ищем первый свободный блок данных по карте, начиная с места
+    // последнего выделения: 64 блока за одно сравнение
+    int words = (superblock.total_blocks + 63) / 64;
+    int start = alloc_hint / 64;
+    for (int i = 0; i <= words; i++) {
+        int word = (start + i) % words;
+        uint64_t bits = free_map[word];
+        if (i == 0) {
+            bits &= ~0ULL << (alloc_hint % 64); // блоки до alloc_hint - в последнюю очередь
+        }
+        if (bits != 0) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+
+    // Свободных нет, но есть отложенные цепочки или блоки, освобожденные
+    // в текущей транзакции: освобождаем порцию и фиксируем транзакцию,
+    // после чего освобожденные блоки можно выделять. Блок ищется только
+    // в начале шага операции, так что фиксация не захватит его половину.
+    int reclaimed = (superblock.reclaim_count > 0) ? reclaim_step(RECLAIM_BATCH) : 0;
+    if ((reclaimed > 0 || map_any(pending_map)) && journal_commit() == 0) {
+        return find_free_block();
+    }
+    return -1; // Если свободные блоки не найдены
+}
+
+// Первый экстент из count свободных блоков, начиная с блока from
+// (потом с начала области данных); -1 - такого нет
+static int find_free_extent(int from, int count) {
+    int run_start = 0, run_length = 0;
+    for (int block = from; block < superblock.total_blocks; block++) {
+        uint64_t bits = free_map[block / 64];
+        if (bits == 0 && block % 64 == 0) {
+            run_length = 0; // 64 занятых блока пропускаем за одно сравнение
+            block += 63;
+            continue;
+        }
+        if ((bits & (1ULL << (block % 64))) == 0) {
+            run_length = 0;
+            continue;
+        }
+        if (run_length++ == 0) {
+            run_start = block;
+        }
+        if (run_length == count) {
+            return run_start;
+        }
+    }
+    return (from > DATA_START) ? find_free_extent(DATA_START, count) : -1;
+}
+
+// Свободны ли все блоки start..start+count-1
+static int range_free(int start, int count) {
+    if (start < DATA_START || start + count > superblock.total_blocks) {
+        return 0;
+    }
+    for (int block = start; block < start + count; block++) {
+        if ((free_map[block / 64] & (1ULL << (block % 64))) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Возвращаем неиспользованный остаток окна дескриптора в карту свободных
+static void file_release(OpenFileEntry *file) {
+    if (file->reserve_count > 0) {
+        map_set_range(free_map, file->reserve_start, file->reserve_count);
+        file->reserve_count = 0;
+    }
+}
+
+// Резервируем за дескриптором окно из count свободных блоков подряд:
+// сразу за последним блоком файла, если там свободно, иначе в первом
+// подходящем экстенте после места последнего выделения. Блоки окна
+// изымаются из free_map, но в FAT остаются свободными: на диск
+// резервирование не попадает. Возвращает 0 или -1, если экстента нет.
+static int file_reserve(OpenFileEntry *file, int count) {
+    int start = -1;
+    if (file->last_block != -1 && range_free(file->last_block + 1, count)) {
+        start = file->last_block + 1;
+    } else {
+        start = find_free_extent(alloc_hint, count);
+    }
+    if (start == -1) {
+        return -1;
+    }
+    file_release(file);
+    for (int block = start; block < start + count; block++) {
+        free_map[block / 64] &= ~(1ULL << (block % 64));
+    }
+    file->reserve_start = start;
+    file->reserve_count = count;
+    alloc_hint = (start + count < superblock.total_blocks) ? start + count : DATA_START;
+    return 0;
+}
+
+// Следующий блок для добавления в файл: из окна дескриптора, а когда оно
+// кончилось - из нового окна (не меньше wanted блоков, если найдется).
+// Если подряд идущих свободных блоков нет, берем любой свободный, в
+// крайнем случае забрав окна у других дескрипторов.
+static int file_next_block(OpenFileEntry *file, int wanted) {
+    if (file->reserve_count == 0) {
+        int count = (wanted > RESERVE_BLOCKS) ? wanted : RESERVE_BLOCKS;
+        if (file_reserve(file, count) == -1 && count > RESERVE_BLOCKS) {
+            file_reserve(file, RESERVE_BLOCKS);
+        }
+    }
+    if (file->reserve_count > 0) {
+        file->reserve_count--;
+        return file->reserve_start++;
+    }
+
+    int block = find_free_block();
+    if (block == -1) {
+        for (int j = 0; j < MAX_OPEN_FILES; j++) {
+            if (open_files[j].fd != -1) {
+                file_release(&open_files[j]);
+            }
+        }
+        block = find_free_block();
+    }
+    return block;
+}
+
+// Присоединяем свободный блок block к концу файла
+static void append_block(OpenFileEntry *file, DirectoryEntry *entry, int block) {
+    free_map[block / 64] &= ~(1ULL << (block % 64));
+    fat_set(block, FAT_EOC);
+    if (file->last_block == -1) {
+        entry->first_block = block;
+    } else {
+        fat_set(file->last_block, block);
+    }
+    file->last_block = block;
+    superblock.free_blocks--;
+    meta_mark_dirty(0);
+    STAT_ADD(fat_allocs, 1);
+    alloc_hint = (block + 1 < superblock.total_blocks) ? block + 1 : DATA_START;
+}
+
+
+// Цепочка файла в записи каталога dir_index укоротилась или переехала:
+// запомненные блоки во всех открытых дескрипторах этого файла больше не годятся
+static void file_chain_changed(int dir_index) {
+    for (int j = 0; j < MAX_OPEN_FILES; j++) {
+        if (open_files[j].fd != -1 && open_files[j].dir_index == dir_index) {
+            open_files[j].last_block = -1;
+            open_files[j].cur_block = -1;
+            open_files[j].current_size = directory_entries[dir_index].size;
+            file_release(&open_files[j]); // окно выбиралось за прежним концом цепочки
+        }
+    }
+}
+
+// Находим последний блок файла по цепочке FAT (запомненный мог
+// устареть, если в файл добавлял другой дескриптор)
+static void file_find_last(OpenFileEntry *file) {
+    DirectoryEntry *entry = &directory_entries[file->dir_index];
+    if (file->last_block != -1 && fat[file->last_block] != FAT_EOC) {
+        file->last_block = -1;
+    }
+    if (file->last_block == -1 && entry->first_block != -1) {
+        file->last_block = entry->first_block;
+        while (fat[file->last_block] != FAT_EOC) {
+            file->last_block = fat[file->last_block];
+        }
+    }
+}
+
+// Входит ли блок в какой-нибудь снимок
+static inline int block_shared(int block) {
+    return (shared_map[block / 64] >> (block % 64)) & 1;
+}
+
+// Блок перед block в цепочке файла, -1 - block первый
+static int chain_prev(DirectoryEntry *entry, int block) {
+    int prev = -1;
+    for (int b = entry->first_block; b != block && b >= DATA_START && b < superblock.total_blocks; b = fat[b]) {
+        prev = b;
+    }
+    return prev;
+}
+
+// Копирование при записи: блок block файла file (prev - предыдущий в
+// цепочке, -1 - block первый) входит в снимок, поэтому файл получает
+// новый блок на его месте в цепочке, с копией данных, если copy.
+// Старый блок освобождается, но остается снимку до его удаления.
+// Возвращает новый блок или -1.
+static int cow_block(OpenFileEntry *file, int prev, int block, int copy) {
+    DirectoryEntry *entry = &directory_entries[file->dir_index];
+    // Последний блок берем из окна дескриптора: за ним пойдут добавления
+    int fresh = (fat[block] == FAT_EOC) ? file_next_block(file, 1) : find_free_block();
+    if (fresh == -1) {
+        return -1; // Диск заполнен
+    }
+    if (copy) {
+        char *data = block_buf_get();
+        if (data == NULL || read_block(data, block) == -1 || write_block(data, fresh) == -1) {
+            block_buf_put(data);
+            free_map[fresh / 64] |= 1ULL << (fresh % 64);
+            return -1;
+        }
+        block_buf_put(data);
+    }
+
+    defrag_cancel(file->dir_index);
+    free_map[fresh / 64] &= ~(1ULL << (fresh % 64));
+    fat_set(fresh, fat[block]);
+    if (prev == -1) {
+        entry->first_block = fresh;
+        dir_mark_dirty(file->dir_index);
+    } else {
+        fat_set(prev, fresh);
+    }
+    superblock.free_blocks--;
+    meta_mark_dirty(0);
+    STAT_ADD(fat_allocs, 1);
+    STAT_ADD(cow_blocks, 1);
+    int old = block;
+    fat[old] = FAT_EOC; // освобождаем только этот блок
+    free_chain(&old, 1);
+
+    // Запомненный блок мог быть в любом дескрипторе этого файла
+    for (int j = 0; j < MAX_OPEN_FILES; j++) {
+        if (open_files[j].fd != -1 && open_files[j].dir_index == file->dir_index) {
+            if (open_files[j].last_block == block) open_files[j].last_block = fresh;
+            if (open_files[j].cur_block == block) open_files[j].cur_block = fresh;
+        }
+    }
+    return fresh;
+}
+
+// Данные файла перестают помещаться в запись каталога: переносим их
+// в первый блок, дальше файл растет обычным образом
+static int inline_spill(OpenFileEntry *file, int wanted) {
+    DirectoryEntry *entry = &directory_entries[file->dir_index];
+    char *data_block = block_buf_get();
+    if (data_block == NULL) {
+        return -1;
+    }
+    int block = file_next_block(file, wanted);
+    if (block == -1) {
+        block_buf_put(data_block);
+        return -1; // Диск заполнен
+    }
+    memset(data_block, 0, BLOCKSIZE);
+    memcpy(data_block, entry->inline_data, entry->size);
+    if (write_block(data_block, block) == -1) {
+        free_map[block / 64] |= 1ULL << (block % 64);
+        block_buf_put(data_block);
+        return -1;
+    }
+    block_buf_put(data_block);
+
+    append_block(file, entry, block);
+    memset(entry->inline_data, 0, INLINE_MAX);
+    dir_mark_dirty(file->dir_index);
+    return 0;
+}
+
+// Добавление n байт из src в конец файла (общая часть sfs_append,
+// sfs_truncate и sfs_pwrite). Возвращает количество добавленных байтов.
+// Запись идет шагами: после каждого цепочка FAT и размер файла снова
+// согласованы, так что транзакция может зафиксироваться между шагами.
+static int append_data(OpenFileEntry *file, char *src, int n) {
+    DirectoryEntry *entry = &directory_entries[file->dir_index];
+    int total_bytes_written = 0; // Общее количество записанных байтов
+    if (journal_reserve(JOURNAL_OP_BLOCKS) == -1) {
+        return -1; // Ошибка записи в диск
+    }
+
+    // Маленький файл растет прямо в записи каталога: создание, запись и
+    // чтение затрагивают один блок каталога и ни одного блока данных
+    if (entry->first_block == -1 && entry->size + n <= superblock.inline_max) {
+        memcpy(entry->inline_data + entry->size, src, n);
+        entry->size += n;
+        file->current_size += n;
+        if (n > 0) {
+            dir_mark_dirty(file->dir_index);
+        }
+        return n;
+    }
+
+    file_find_last(file);
+    if (entry->first_block == -1 && entry->size > 0 &&
+        inline_spill(file, (entry->size + n + BLOCKSIZE - 1) / BLOCKSIZE) == -1) {
+        return 0; // Ничего не записано
+    }
+
+    char *data_block = block_buf_get(); // Буфер для неполных блоков
+    if (data_block == NULL) {
+        return -1;
+    }
+
+    // Пока есть данные для записи
+    while (total_bytes_written < n) {
+        int left = n - total_bytes_written;
+        int offset = entry->size % BLOCKSIZE;
+
+        // Выделение блоков заодно продвигает отложенное освобождение
+        if (offset == 0 && superblock.reclaim_count > 0) {
+            reclaim_step(RECLAIM_BATCH);
+        }
+
+        // Шаг добавляет не больше APPEND_STEP_BLOCKS блоков подряд: они
+        // меняют не больше wanted / FAT_ENTRIES_PER_BLOCK + 2 блоков FAT
+        int wanted = (left + BLOCKSIZE - 1) / BLOCKSIZE;
+        if (wanted > APPEND_STEP_BLOCKS) wanted = APPEND_STEP_BLOCKS;
+        if (journal_reserve(wanted / FAT_ENTRIES_PER_BLOCK + JOURNAL_OP_BLOCKS) == -1) {
+            break;
+        }
+
+        if (offset != 0) {
+            // Последний блок заполнен не до конца: дописываем его (если
+            // он входит в снимок - его копию)
+            if (block_shared(file->last_block) &&
+                cow_block(file, chain_prev(entry, file->last_block), file->last_block, 1) == -1) {
+                break;
+            }
+            int bytes_to_copy = BLOCKSIZE - offset;
+            if (bytes_to_copy > left) bytes_to_copy = left;
+            if (read_block(data_block, file->last_block) == -1) {
+                break;
+            }
+            memcpy(data_block + offset, src + total_bytes_written, bytes_to_copy);
+            if (write_block(data_block, file->last_block) == -1) {
+                break;
+            }
+            entry->size += bytes_to_copy;
+            file->current_size += bytes_to_copy;
+            total_bytes_written += bytes_to_copy;
+            dir_mark_dirty(file->dir_index);
+            continue;
+        }
+
+        // Выделяем серию подряд идущих блоков из окна дескриптора под
+        // данные шага, чтобы записать полные блоки одним пакетом
+        int run_start = -1;
+        int run_length = 0;
+        while (run_length < wanted) {
+            if (run_length > 0 && (file->reserve_count == 0 || file->reserve_start != run_start + run_length)) {
+                break; // Окно кончилось: следующий блок будет в другом месте
+            }
+            int free_block = file_next_block(file, wanted - run_length);
+            if (free_block == -1) {
+                break;
+            }
+            if (run_length == 0) {
+                run_start = free_block;
+            }
+            append_block(file, entry, free_block);
+            run_length++;
+        }
+        if (run_length == 0) {
+            break; // Диск заполнен: возвращаем то, что было записано
+        }
+
+        int full_blocks = left / BLOCKSIZE;
+        if (full_blocks > run_length) full_blocks = run_length;
+        if (full_blocks > 0) {
+            if (write_blocks(src + total_bytes_written, run_start, full_blocks) == -1) {
+                break;
+            }
+            entry->size += full_blocks * BLOCKSIZE;
+            file->current_size += full_blocks * BLOCKSIZE;
+            total_bytes_written += full_blocks * BLOCKSIZE;
+        }
+        if (full_blocks < run_length) {
+            // Хвост данных меньше блока
+            int bytes_to_copy = n - total_bytes_written;
+            memset(data_block, 0, BLOCKSIZE);
+            memcpy(data_block, src + total_bytes_written, bytes_to_copy);
+            if (write_block(data_block, run_start + full_blocks) == -1) {
+                break;
+            }
+            entry->size += bytes_to_copy;
+            file->current_size += bytes_to_copy;
+            total_bytes_written += bytes_to_copy;
+        }
+        // Новые размер и цепочка FAT попадут на диск с транзакцией журнала
+        dir_mark_dirty(file->dir_index);
+    }
+
+    block_buf_put(data_block);
+    return total_bytes_written;
+}
+
+
+static int file_append(int fd, void *buf, int n) {
+    // Проверка допустимости дескриптора файла
+    if (fd < 0 || fd >= MAX_OPEN_FILES || n < 0) {
+        return -1; // Ошибка: недопустимый дескриптор
+    }
+
+    // Проверка, открыт ли файл на добавление
+    if (open_files[fd].fd == -1 || open_files[fd].mode != MODE_APPEND) {
+        return -1; // Ошибка: файл не открыт
+    }
+
+    int total_bytes_written = append_data(&open_files[fd], buf, n);
+    if (journal_op_done() == -1) {
+        return -1;
+    }
+    return total_bytes_written; // Возвращаем количество успешно добавленных байтов
+}
+
+int sfs_append(int fd, void *buf, int n) {
+    long long start = stats_start(SFS_OP_APPEND);
+    int ret = file_append(fd, buf, n);
+    stats_time(SFS_OP_APPEND, start);
+    record_call(start, ret, "append %d %d", fd, n);
+    if (ret > 0) {
+        STAT_ADD(bytes_written, ret);
+    }
+    return ret;
+}
+
+
+static int file_fallocate(int fd, int bytes) {
+    // Проверка допустимости дескриптора файла
+    if (fd < 0 || fd >= MAX_OPEN_FILES || bytes < 0) {
+        return -1; // Ошибка: недопустимый дескриптор
+    }
+
+    // Резервировать место можно только под файл, открытый на запись
+    if (open_files[fd].fd == -1 || open_files[fd].mode != MODE_APPEND) {
+        return -1; // Ошибка: файл не открыт
+    }
+
+    OpenFileEntry *file = &open_files[fd];
+    DirectoryEntry *entry = &directory_entries[file->dir_index];
+
+    // Сколько блоков не хватает до bytes байт сверх уже выделенных и окна
+    int needed = (bytes + BLOCKSIZE - 1) / BLOCKSIZE - (entry->size + BLOCKSIZE - 1) / BLOCKSIZE;
+    if (needed <= file->reserve_count) {
+        return 0; // Места уже достаточно
+    }
+
+    // Новое окно должно вместить все нужные блоки подряд
+    file_find_last(file);
+    if (file_reserve(file, needed) == -1) {
+        return -1; // Ошибка: нет столько свободных блоков подряд
+    }
+    return 0;
+}
+
+
+static int file_truncate(int fd, int new_size) {
+    // Проверка допустимости дескриптора файла
+    if (fd < 0 || fd >= MAX_OPEN_FILES || new_size < 0) {
+        return -1; // Ошибка: недопустимый дескриптор
+    }
+
+    // Изменять можно только файл, открытый на запись
+    if (open_files[fd].fd == -1 || open_files[fd].mode != MODE_APPEND) {
+        return -1; // Ошибка: файл не открыт
+    }
+
+    OpenFileEntry *file = &open_files[fd];
+    DirectoryEntry *entry = &directory_entries[file->dir_index];
+    if (journal_reserve(JOURNAL_OP_BLOCKS) == -1) {
+        return -1; // Ошибка записи в диск
+    }
+
+    if (new_size > entry->size) {
+        // Увеличение: дописываем нули
+        char *zeros = block_buf_get();
+        if (zeros == NULL) {
+            return -1;
+        }
+        memset(zeros, 0, DIRECT_IO_ALIGN);
+        while (entry->size < new_size) {
+            int chunk = new_size - entry->size;
+            if (chunk > DIRECT_IO_ALIGN) chunk = DIRECT_IO_ALIGN;
+            if (append_data(file, zeros, chunk) != chunk) {
+                block_buf_put(zeros);
+                journal_op_done();
+                return -1; // Диск заполнен
+            }
+        }
+        block_buf_put(zeros);
+    } else if (new_size < entry->size && entry->first_block == -1) {
+        // Данные в записи каталога: обнуляем отрезанный хвост
+        memset(entry->inline_data + new_size, 0, entry->size - new_size);
+        entry->size = new_size;
+        dir_mark_dirty(file->dir_index);
+        file_chain_changed(file->dir_index);
+    } else if (new_size < entry->size) {
+        // Уменьшение: оставляем первые keep блоков цепочки, отрезанный
+        // хвост ставится в очередь отложенного освобождения. Обрыв цепочки,
+        // новый размер и очередь попадают в одну транзакцию, а блоки
+        // освобождаются потом порциями, как у удаленного файла.
+        defrag_cancel(file->dir_index);
+        int keep = (new_size + BLOCKSIZE - 1) / BLOCKSIZE;
+        int head;
+        if (keep == 0) {
+            head = entry->first_block;
+            entry->first_block = -1;
+        } else {
+            int last = entry->first_block;
+            for (int i = 1; i < keep; i++) {
+                last = fat[last];
+            }
+            head = fat[last];
+            fat_set(last, FAT_EOC);
+        }
+        if (head >= DATA_START && head < superblock.total_blocks) {
+            reclaim_push(head);
+        }
+        entry->size = new_size;
+        dir_mark_dirty(file->dir_index);
+        file_chain_changed(file->dir_index);
+    }
+
+    return journal_op_done();
+}
+
+int sfs_fallocate(int fd, int bytes) {
+    long long start = stats_clock();
+    trace_call = SFS_CALL_FALLOCATE;
+    int ret = file_fallocate(fd, bytes);
+    record_call(start, ret, "fallocate %d %d", fd, bytes);
+    return ret;
+}
+
+int sfs_truncate(int fd, int new_size) {
+    long long start = stats_start(SFS_OP_TRUNCATE);
+    int ret = file_truncate(fd, new_size);
+    stats_time(SFS_OP_TRUNCATE, start);
+    record_call(start, ret, "truncate %d %d", fd, new_size);
+    return ret;
+}
+
+
+static int file_pwrite(int fd, void *buf, int n, int offset) {
+    // Проверка допустимости дескриптора файла
+    if (fd < 0 || fd >= MAX_OPEN_FILES || n < 0 || offset < 0) {
+        return -1; // Ошибка: недопустимый дескриптор
+    }
+
+    // Писать можно только в файл, открытый на запись
+    if (open_files[fd].fd == -1 || open_files[fd].mode != MODE_APPEND) {
+        return -1; // Ошибка: файл не открыт
+    }
+
+    OpenFileEntry *file = &open_files[fd];
+    DirectoryEntry *entry = &directory_entries[file->dir_index];
+    char *src = buf;
+    int written = 0;
+    if (journal_reserve(JOURNAL_OP_BLOCKS) == -1) {
+        return -1; // Ошибка записи в диск
+    }
+
+    // Запись за концом файла: промежуток заполняется нулями
+    if (offset > entry->size && file_truncate(fd, offset) == -1) {
+        return -1;
+    }
+
+    // Перезапись существующих байтов на месте, в уже выделенных блоках
+    int overwrite = entry->size - offset;
+    if (overwrite > n) overwrite = n;
+    if (overwrite > 0 && entry->first_block == -1) {
+        // Данные в записи каталога
+        memcpy(entry->inline_data + offset, src, overwrite);
+        written = overwrite;
+        dir_mark_dirty(file->dir_index);
+    } else if (overwrite > 0) {
+        char *data_block = block_buf_get();
+        if (data_block == NULL) {
+            return -1;
+        }
+        int prev = -1, block = entry->first_block;
+        for (int i = 0; i < offset / BLOCKSIZE; i++) {
+            prev = block;
+            block = fat[block];
+        }
+
+        while (written < overwrite) {
+            int in_block = (offset + written) % BLOCKSIZE;
+            int left = overwrite - written;
+
+            // Блок снимка заменяем копией; целый блок копировать незачем.
+            // Каждая копия - отдельный шаг со своим местом в транзакции.
+            if (block_shared(block) &&
+                (journal_reserve(JOURNAL_OP_BLOCKS) == -1 ||
+                 (block = cow_block(file, prev, block, in_block != 0 || left < BLOCKSIZE)) == -1)) {
+                break;
+            }
+
+            if (in_block == 0 && left >= BLOCKSIZE) {
+                // Целые блоки: серию подряд лежащих блоков пишем одним пакетом
+                int run = 1;
+                while (run < left / BLOCKSIZE && fat[block + run - 1] == block + run && !block_shared(block + run)) {
+                    run++;
+                }
+                if (write_blocks(src + written, block, run) == -1) {
+                    break;
+                }
+                written += run * BLOCKSIZE;
+                prev = block + run - 1;
+                block = fat[prev];
+                continue;
+            }
+
+            // Часть блока: читаем, меняем, пишем обратно
+            int chunk = BLOCKSIZE - in_block;
+            if (chunk > left) chunk = left;
+            if (read_block(data_block, block) == -1) {
+                break;
+            }
+            memcpy(data_block + in_block, src + written, chunk);
+            if (write_block(data_block, block) == -1) {
+                break;
+            }
+            written += chunk;
+            if ((offset + written) % BLOCKSIZE == 0) {
+                prev = block;
+                block = fat[block];
+            }
+        }
+        block_buf_put(data_block);
+    }
+
+    // Остаток за концом файла добавляется как обычно
+    if (written == overwrite && written < n) {
+        int appended = append_data(file, src + written, n - written);
+        if (appended > 0) {
+            written += appended;
+        }
+    }
+
+    if (journal_op_done() == -1) {
+        return -1;
+    }
+    return written; // Возвращаем количество записанных байтов
+}
+
+int sfs_pwrite(int fd, void *buf, int n, int offset) {
+    long long start = stats_start(SFS_OP_PWRITE);
+    int ret = file_pwrite(fd, buf, n, offset);
+    stats_time(SFS_OP_PWRITE, start);
+    record_call(start, ret, "pwrite %d %d %d", fd, n, offset);
+    if (ret > 0) {
+        STAT_ADD(bytes_written, ret);
+    }
+    return ret;
+}
+
+
+
+
+static int entry_delete(char *filename) {
+    // Проверка имени файла
+    if (filename == NULL) {
+        return -1; // Ошибка: имя файла не может быть NULL
+    }
+
+    // Поиск файла по пути
+    int i = path_lookup(filename);
+    if (i == -1) {
+        return -1; // Ошибка: файл не найден в каталоге
+    }
+    if (directory_entries[i].children > 0) {
+        return -1; // Ошибка: каталог не пуст
+    }
+
+    // Открытый файл удалять нельзя
+    for (int j = 0; j < MAX_OPEN_FILES; j++) {
+        if (open_files[j].fd != -1 && open_files[j].dir_index == i) {
+            return -1; // Ошибка: файл открыт
+        }
+    }
+
+    if (journal_reserve(JOURNAL_OP_BLOCKS) == -1) {
+        return -1; // Ошибка записи в диск
+    }
+    defrag_cancel(i);
+
+    // Цепочка ставится в очередь отложенного освобождения в суперблоке,
+    // в той же транзакции, что и удаление записи: блоки освобождаются
+    // потом порциями, каждая в своей транзакции
+    if (directory_entries[i].first_block != -1) {
+        reclaim_push(directory_entries[i].first_block);
+    }
+
+    // Удаляем запись из каталога
+    dentry_remove(i);
+    (*dir_children(directory_entries[i].parent))--;
+    memset(&directory_entries[i], 0, sizeof(DirectoryEntry)); // Очищаем имя, размер и данные
+    directory_entries[i].first_block = -1; // Устанавливаем первый блок в -1
+    directory_entries[i].parent = DIR_ROOT;
+    dir_mark_dirty(i);
+    if (i < dir_free_hint) {
+        dir_free_hint = i;
+    }
+    files_count--;
+
+    if (journal_op_done() == -1) {
+        return -1; // Ошибка записи на диск
+    }
+    return 0; // Успешное удаление файла
+}
+
+int sfs_delete(char *filename) {
+    long long start = stats_start(SFS_OP_DELETE);
+    int ret = entry_delete(filename);
+    stats_time(SFS_OP_DELETE, start);
+    record_named(start, ret, "delete", filename, "");
+    return ret;
+}
+
+
+// Сведения о файле в записи каталога entry
+static void dir_entry_stat(const DirectoryEntry *entry, SfsStat *st) {
+    memcpy(st->name, entry->filename, sizeof(st->name));
+    st->type = entry->type;
+    st->size = entry->size;
+    st->first_block = entry->first_block;
+    // В целой цепочке ровно столько блоков, сколько нужно под размер
+    st->blocks = (entry->first_block == -1) ? 0 : (entry->size + BLOCKSIZE - 1) / BLOCKSIZE;
+}
+
+static int entry_stat(char *filename, SfsStat *st) {
+    if (filename == NULL || st == NULL) {
+        return -1; // Ошибка: имя файла не может быть NULL
+    }
+    int i = path_lookup(filename);
+    if (i == -1) {
+        return -1; // Ошибка: файл не найден
+    }
+    dir_entry_stat(&directory_entries[i], st);
+    return 0;
+}
+
+int sfs_stat(char *filename, SfsStat *st) {
+    long long start = stats_clock();
+    int ret = entry_stat(filename, st);
+    record_named(start, ret, "stat", filename, "");
+    return ret;
+}
+
+int sfs_opendir(char *dirname) {
+    // Корень - "/" (или пустой путь), иначе запись типа каталог
+    int dir = DIR_ROOT;
+    if (dirname == NULL) {
+        return -1; // Ошибка: каталог не найден
+    }
+    if (dirname[strspn(dirname, "/")] != '\0') {
+        dir = path_lookup(dirname);
+        if (dir == -1 || directory_entries[dir].type != DIR_TYPE_DIR) {
+            return -1; // Ошибка: каталог не найден
+        }
+    }
+    int children = *dir_children(dir);
+
+    for (int d = 0; d < MAX_OPEN_DIRS; d++) {
+        if (open_dirs[d].entries != NULL) {
+            continue;
+        }
+        // Снимок делается одним проходом по таблице записей в памяти
+        SfsStat *entries = malloc((children > 0 ? children : 1) * sizeof(SfsStat));
+        if (entries == NULL) {
+            return -1; // Ошибка выделения памяти
+        }
+        int count = 0;
+        for (int i = 0; i < dir_slots && count < children; i++) {
+            if (directory_entries[i].filename[0] != '\0' && directory_entries[i].parent == dir) {
+                dir_entry_stat(&directory_entries[i], &entries[count++]);
+            }
+        }
+        open_dirs[d].entries = entries;
+        open_dirs[d].count = count;
+        open_dirs[d].next = 0;
+        return d;
+    }
+    return -1; // Ошибка: слишком много открытых просмотров
+}
+
+int sfs_readdir(int dd, SfsStat *entries, int max) {
+    if (dd < 0 || dd >= MAX_OPEN_DIRS || open_dirs[dd].entries == NULL || entries == NULL || max < 0) {
+        return -1; // Ошибка: недопустимый дескриптор
+    }
+    OpenDirEntry *dir = &open_dirs[dd];
+    int n = dir->count - dir->next;
+    if (n > max) n = max;
+    memcpy(entries, dir->entries + dir->next, (size_t) n * sizeof(SfsStat));
+    dir->next += n;
+    return n; // 0 - записи кончились
+}
+
+int sfs_closedir(int dd) {
+    if (dd < 0 || dd >= MAX_OPEN_DIRS || open_dirs[dd].entries == NULL) {
+        return -1; // Ошибка: недопустимый дескриптор
+    }
+    free(open_dirs[dd].entries);
+    open_dirs[dd].entries = NULL;
+    return 0;
+}
+
+
+/**********************************************************************
+   Дефрагментация (sfs_defrag)
+***********************************************************************/
+
+// Файл больше не переносится: неиспользованный остаток экстента
+// возвращается в карту свободных блоков
+static void defrag_cancel(int dir_index) {
+    if (defrag_file == -1 || defrag_file != dir_index) {
+        return;
+    }
+    if (defrag_moved < defrag_length) {
+        map_set_range(free_map, defrag_target + defrag_moved, defrag_length - defrag_moved);
+    }
+    defrag_file = -1;
+}
+
+// Выбираем следующий файл, цепочка которого лежит не одним куском, и
+// резервируем для него экстент. 0 - за проход по каталогу таких не нашлось.
+static int defrag_pick() {
+    for (int i = defrag_next; i < dir_slots; i++) {
+        DirectoryEntry *entry = &directory_entries[i];
+        if (entry->filename[0] == '\0' || entry->first_block == -1) {
+            continue;
+        }
+
+        // Считаем блоки и проверяем, идут ли они подряд
+        int count = 0, contiguous = 1;
+        for (int block = entry->first_block; block != FAT_EOC && count < superblock.total_blocks; block = fat[block]) {
+            if (fat[block] != FAT_EOC && fat[block] != block + 1) {
+                contiguous = 0;
+            }
+            count++;
+        }
+        if (contiguous) {
+            continue;
+        }
+
+        int target = find_free_extent(DATA_START, count);
+        if (target == -1) {
+            continue; // Нет подходящего свободного места: файл остается как есть
+        }
+        for (int block = target; block < target + count; block++) {
+            free_map[block / 64] &= ~(1ULL << (block % 64));
+        }
+        defrag_file = i;
+        defrag_target = target;
+        defrag_length = count;
+        defrag_moved = 0;
+        defrag_next = i + 1;
+        return 1;
+    }
+    defrag_next = 0;
+    return 0;
+}
+
+// Переносим до max_blocks очередных блоков выбранного файла в экстент.
+// Цепочка остается целой после каждого шага: перенесенное начало лежит
+// в экстенте и продолжается старыми блоками.
+static int defrag_move(int max_blocks) {
+    DirectoryEntry *entry = &directory_entries[defrag_file];
+    int dst = defrag_target + defrag_moved;
+    int count = defrag_length - defrag_moved;
+    if (count > max_blocks) count = max_blocks;
+
+    char *data = block_buf_get();
+    if (data == NULL) {
+        return -1;
+    }
+
+    // Копируем данные: серии подряд лежащих старых блоков - пакетами
+    // по строке ввода-вывода
+    int head = (defrag_moved == 0) ? entry->first_block : fat[dst - 1];
+    int block = head;
+    for (int done = 0; done < count; ) {
+        int run = 1;
+        while (done + run < count && run < CACHE_LINE_BLOCKS && fat[block + run - 1] == block + run) {
+            run++;
+        }
+        if (read_blocks(data, block, run) == -1 || write_blocks(data, dst + done, run) == -1) {
+            block_buf_put(data);
+            return -1;
+        }
+        done += run;
+        block = fat[block + run - 1];
+    }
+    block_buf_put(data);
+
+    // Новая цепочка: блоки экстента подряд, последний ведет к оставшимся
+    // старым блокам. Старые освобождаются через pending_map и не будут
+    // выделены заново до фиксации транзакции с новой FAT.
+    for (int i = 0; i < count - 1; i++) {
+        fat_set(dst + i, dst + i + 1);
+    }
+    fat_set(dst + count - 1, block);
+    if (defrag_moved == 0) {
+        entry->first_block = dst;
+        dir_mark_dirty(defrag_file);
+    } else {
+        fat_set(dst - 1, dst);
+    }
+    superblock.free_blocks -= count;
+    STAT_ADD(fat_allocs, count);
+    free_chain(&head, count);
+
+    file_chain_changed(defrag_file);
+    defrag_moved += count;
+    if (defrag_moved == defrag_length) {
+        defrag_file = -1;
+    }
+    return count;
+}
+
+static int volume_defrag(int max_blocks) {
+    if (superblock.total_blocks == 0 || max_blocks <= 0) {
+        return -1; // Ошибка: диск не отформатирован
+    }
+
+    int moved = 0;
+    while (moved < max_blocks) {
+        if (defrag_file == -1 && !defrag_pick()) {
+            break; // Все файлы, которые можно, уже лежат непрерывно
+        }
+        // Шаг переносит до DEFRAG_STEP_BLOCKS блоков. Старые блоки могут
+        // лежать каждый в своем блоке FAT - место резервируется под все.
+        int step = max_blocks - moved;
+        if (step > DEFRAG_STEP_BLOCKS) step = DEFRAG_STEP_BLOCKS;
+        int n = -1;
+        if (journal_reserve(step + step / FAT_ENTRIES_PER_BLOCK + JOURNAL_OP_BLOCKS) == 0) {
+            n = defrag_move(step);
+        }
+        if (n == -1) {
+            defrag_cancel(defrag_file);
+            return -1; // Ошибка ввода-вывода
+        }
+        moved += n;
+    }
+
+    if (journal_op_done() == -1) {
+        return -1;
+    }
+    return moved; // Возвращаем количество перенесенных блоков
+}
+
+int sfs_defrag(int max_blocks) {
+    long long start = stats_clock();
+    trace_call = SFS_CALL_DEFRAG;
+    int ret = volume_defrag(max_blocks);
+    record_call(start, ret, "defrag %d", max_blocks);
+    return ret;
+}
+
+
+/**********************************************************************
+   Снимки тома (sfs_snapshot)
+***********************************************************************/
+
+// Проходим цепочки всех файлов снимка s и меняем счетчики ссылок их
+// блоков на delta. Блок, который больше никто не держит, уходит из
+// shared_map; если том его уже освободил, он снова свободен.
+static void snapshot_refs_add(Snapshot *s, int delta) {
+    int run_start = -1, run_length = 0;
+    for (int i = 0; i < s->slots; i++) {
+        DirectoryEntry *entry = &s->entries[i];
+        if (entry->filename[0] == '\0' || entry->type != DIR_TYPE_FILE) {
+            continue;
+        }
+        int count = 0;
+        for (int block = entry->first_block; block >= DATA_START && block < s->total_blocks &&
+                                             count < s->total_blocks; block = s->fat[block], count++) {
+            uint64_t bit = 1ULL << (block % 64);
+            if (delta > 0) {
+                if (snapshot_refs[block]++ == 0) {
+                    shared_map[block / 64] |= bit;
+                }
+                continue;
+            }
+            if (--snapshot_refs[block] > 0) {
+                continue;
+            }
+            shared_map[block / 64] &= ~bit;
+            if (held_map[block / 64] & bit) {
+                held_map[block / 64] &= ~bit;
+                free_map[block / 64] |= bit;
+                if (mount_flags & MOUNT_PUNCH_HOLES) {
+                    // Соседние блоки отдаем хосту одним вызовом
+                    if (run_length > 0 && block != run_start + run_length) {
+                        punch_hole(run_start, run_length);
+                        run_length = 0;
+                    }
+                    if (run_length++ == 0) {
+                        run_start = block;
+                    }
+                }
+            }
+        }
+    }
+    if (run_length > 0) {
+        punch_hole(run_start, run_length);
+    }
+}
+
+static void snapshot_free(int snap) {
+    Snapshot *s = snapshots[snap];
+    snapshot_refs_add(s, -1);
+    snapshots[snap] = NULL;
+    snapshot_count--;
+    free(s->entries);
+    free(s->fat);
+    free(s);
+}
+
+// Том размонтируется или форматируется: снимки больше не читаются
+static void snapshot_free_all() {
+    for (int snap = 0; snap < SFS_MAX_SNAPSHOTS; snap++) {
+        if (snapshots[snap] != NULL) {
+            snapshot_free(snap);
+        }
+    }
+}
+
+int sfs_snapshot() {
+    if (superblock.total_blocks == 0) {
+        return -1; // Ошибка: диск не смонтирован
+    }
+    int snap = 0;
+    while (snap < SFS_MAX_SNAPSHOTS && snapshots[snap] != NULL) {
+        snap++;
+    }
+    if (snap == SFS_MAX_SNAPSHOTS) {
+        return -1; // Ошибка: слишком много снимков
+    }
+    if (snapshot_refs == NULL && (snapshot_refs = calloc(FAT_ENTRIES, 1)) == NULL) {
+        return -1;
+    }
+
+    // Копируем таблицу записей и FAT; данные остаются на месте
+    Snapshot *s = calloc(1, sizeof(Snapshot));
+    if (s == NULL) {
+        return -1;
+    }
+    s->slots = dir_slots;
+    s->total_blocks = superblock.total_blocks;
+    s->entries = malloc((size_t) dir_slots * sizeof(DirectoryEntry));
+    s->fat = malloc((size_t) s->total_blocks * sizeof(int));
+    if (s->entries == NULL || s->fat == NULL) {
+        free(s->entries);
+        free(s->fat);
+        free(s);
+        return -1;
+    }
+    memcpy(s->entries, directory_entries, (size_t) dir_slots * sizeof(DirectoryEntry));
+    memcpy(s->fat, fat, (size_t) s->total_blocks * sizeof(int));
+
+    snapshot_refs_add(s, 1);
+    snapshots[snap] = s;
+    snapshot_count++;
+    return snap;
+}
+
+int sfs_snapshot_release(int snap) {
+    if (snap < 0 || snap >= SFS_MAX_SNAPSHOTS || snapshots[snap] == NULL) {
+        return -1; // Ошибка: нет такого снимка
+    }
+    snapshot_free(snap);
+    return 0;
+}
+
+// Запись по пути в снимке s; в *index - ее номер (DIR_ROOT - корень).
+// Поиск - проход по таблице снимка для каждого компонента пути.
+static int snapshot_lookup(Snapshot *s, const char *path, int *index) {
+    int dir = DIR_ROOT;
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        size_t length = strcspn(path, "/");
+        if (length == 0) {
+            break;
+        }
+        if (dir != DIR_ROOT && s->entries[dir].type != DIR_TYPE_DIR) {
+            return -1; // файл в середине пути
+        }
+        int next = -1;
+        for (int i = 0; i < s->slots; i++) {
+            if (s->entries[i].parent == dir && s->entries[i].filename[0] != '\0' &&
+                strncmp(s->entries[i].filename, path, length) == 0 && s->entries[i].filename[length] == '\0') {
+                next = i;
+                break;
+            }
+        }
+        if (next == -1) {
+            return -1; // нет такой записи
+        }
+        dir = next;
+        path += length;
+    }
+    *index = dir;
+    return 0;
+}
+
+static Snapshot *snapshot_get(int snap) {
+    return (snap >= 0 && snap < SFS_MAX_SNAPSHOTS) ? snapshots[snap] : NULL;
+}
+
+int sfs_snapshot_stat(int snap, char *path, SfsStat *st) {
+    Snapshot *s = snapshot_get(snap);
+    int index;
+    if (s == NULL || path == NULL || st == NULL || snapshot_lookup(s, path, &index) == -1 || index == DIR_ROOT) {
+        return -1; // Ошибка: нет такого снимка или файла
+    }
+    dir_entry_stat(&s->entries[index], st);
+    return 0;
+}
+
+int sfs_snapshot_list(int snap, char *dirname, SfsStat *entries, int max) {
+    Snapshot *s = snapshot_get(snap);
+    int dir, count = 0;
+    if (s == NULL || dirname == NULL || entries == NULL || max < 0 || snapshot_lookup(s, dirname, &dir) == -1 ||
+        (dir != DIR_ROOT && s->entries[dir].type != DIR_TYPE_DIR)) {
+        return -1; // Ошибка: нет такого снимка или каталога
+    }
+    for (int i = 0; i < s->slots && count < max; i++) {
+        if (s->entries[i].filename[0] != '\0' && s->entries[i].parent == dir) {
+            dir_entry_stat(&s->entries[i], &entries[count++]);
+        }
+    }
+    return count;
+}
+
+// Читаем до n байт файла entry снимка s с позиции offset. Блоки снимка
+// не меняются, пока он есть, поэтому они читаются прямо с диска (pread
+// строки ввода-вывода), мимо кэша и без общих изменяемых данных тома.
+// cursor (если не NULL и не -1) - блок, содержащий offset, тогда цепочка
+// не проходится с начала; в него записывается блок, где чтение кончилось.
+static int snapshot_file_read(Snapshot *s, DirectoryEntry *entry, char *dst, int n, int offset, int *cursor) {
+    if (offset >= entry->size) {
+        return 0;
+    }
+    if (n > entry->size - offset) {
+        n = entry->size - offset;
+    }
+    if (entry->first_block == -1) {
+        memcpy(dst, entry->inline_data + offset, n);
+        return n;
+    }
+
+    char *line = block_buf_get();
+    if (line == NULL) {
+        return -1;
+    }
+    int block = entry->first_block;
+    if (cursor != NULL && *cursor != -1) {
+        block = *cursor;
+    } else {
+        for (int i = 0; i < offset / BLOCKSIZE && block >= DATA_START && block < s->total_blocks; i++) {
+            block = s->fat[block];
+        }
+    }
+    int done = 0, loaded = -1;
+    while (done < n && block >= DATA_START && block < s->total_blocks) {
+        if (block / CACHE_LINE_BLOCKS != loaded) {
+            loaded = block / CACHE_LINE_BLOCKS;
+            if (disk_read(line, (off_t) loaded * DIRECT_IO_ALIGN, DIRECT_IO_ALIGN) == -1) {
+                break;
+            }
+        }
+        int in_block = (offset + done) % BLOCKSIZE;
+        int chunk = BLOCKSIZE - in_block;
+        if (chunk > n - done) chunk = n - done;
+        memcpy(dst + done, line + (block % CACHE_LINE_BLOCKS) * BLOCKSIZE + in_block, chunk);
+        done += chunk;
+        if ((offset + done) % BLOCKSIZE == 0) {
+            block = s->fat[block];
+        }
+    }
+    block_buf_put(line);
+    if (cursor != NULL) {
+        *cursor = block;
+    }
+    return (done < n) ? -1 : done;
+}
+
+int sfs_snapshot_read(int snap, char *path, void *buf, int n, int offset) {
+    Snapshot *s = snapshot_get(snap);
+    int index;
+    if (s == NULL || path == NULL || buf == NULL || n < 0 || offset < 0 ||
+        snapshot_lookup(s, path, &index) == -1 || index == DIR_ROOT || s->entries[index].type != DIR_TYPE_FILE) {
+        return -1; // Ошибка: нет такого снимка или файла
+    }
+    return snapshot_file_read(s, &s->entries[index], buf, n, offset, NULL);
+}
+
+int sfs_snapshot_export(int snap, char *hostdir) {
+    Snapshot *s = snapshot_get(snap);
+    char path[1024];
+    if (s == NULL || hostdir == NULL || (mkdir(hostdir, 0755) == -1 && errno != EEXIST)) {
+        return -1;
+    }
+    int *depth = malloc((s->slots > 0 ? s->slots : 1) * sizeof(int));
+    char *buf = malloc(EXPORT_CHUNK);
+    if (depth == NULL || buf == NULL) {
+        free(depth);
+        free(buf);
+        return -1;
+    }
+
+    // Каталоги создаются раньше своих записей: обход по глубине
+    int ret = 0, base = strlen(hostdir);
+    int max_depth = entry_depths(s->entries, s->slots, depth);
+    strcpy(path, hostdir);
+    for (int d = 0; d <= max_depth && ret == 0; d++) {
+        for (int i = 0; i < s->slots && ret == 0; i++) {
+            DirectoryEntry *entry = &s->entries[i];
+            if (entry->filename[0] == '\0' || depth[i] != d) {
+                continue;
+            }
+            if (entry_path(s->entries, s->slots, i, path + base, sizeof(path) - base) == -1) {
+                ret = -1;
+                break;
+            }
+            if (entry->type == DIR_TYPE_DIR) {
+                if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+                    ret = -1;
+                }
+                continue;
+            }
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                ret = -1;
+                break;
+            }
+            int cursor = -1;
+            for (int done = 0; done < entry->size && ret == 0; ) {
+                int n = snapshot_file_read(s, entry, buf, EXPORT_CHUNK, done, &cursor);
+                if (n <= 0 || write(fd, buf, n) != n) {
+                    ret = -1;
+                }
+                done += n;
+            }
+            if (close(fd) == -1) {
+                ret = -1;
+            }
+        }
+    }
+    free(depth);
+    free(buf);
+    return ret;
+}
+
+
+/**********************************************************************
+   Проверка целостности файловой системы (sfs_fsck)
+***********************************************************************/
+
+#define FSCK_MAX_THREADS 8
+// Проверяемые цепочки: записи каталогов (slots), затем очередь отложенного
+// освобождения, последняя - цепочка продолжения таблицы записей
+#define FSCK_RECLAIM(scan, r) ((scan)->slots + (r))
+#define FSCK_EXT(scan) ((scan)->slots + RECLAIM_MAX)
+
+// Найденные у файла ошибки
+#define FSCK_BAD_ENTRY 0x01   // испорчена запись каталога
+#define FSCK_BAD_POINTER 0x02 // цепочка указывает за пределы области данных
+#define FSCK_CROSS_LINK 0x04  // блок принадлежит и другому файлу
+#define FSCK_LOOP 0x08        // цепочка зациклена
+#define FSCK_FREE_LINK 0x10   // цепочка ведет в свободный блок
+#define FSCK_TOO_LONG 0x20    // блоков больше, чем нужно для размера
+#define FSCK_TOO_SHORT 0x40   // блоков меньше, чем нужно для размера
+#define FSCK_BAD_PARENT 0x80  // запись не достижима из корня
+
+// Результат проверки одного файла
+typedef struct {
+    int errors; // флаги FSCK_*
+    int keep;   // сколько блоков цепочки остается у файла
+    int last;   // последний оставляемый блок (-1 - ни одного)
+    int cut;    // цепочку нужно оборвать после last
+    int other;  // файл, с которым найдено пересечение
+} FsckFile;
+
+// Состояние проверки, общее для потоков
+typedef struct {
+    const int *fat;                 // FAT в отображенном образе диска
+    SuperBlock sb;
+    int slots;                      // записей в таблице (корень + продолжение)
+    int ext_blocks;                 // блоков в цепочке продолжения
+    int chains;                     // slots + RECLAIM_MAX + 1
+    DirectoryEntry *dir;
+    FsckFile *files;
+    int *owner;                     // 1 + наименьший индекс цепочки, проходящей через блок
+    unsigned char *seen;            // блок остается у своего файла
+    int threads;
+    int free_count[FSCK_MAX_THREADS];
+    int orphans[FSCK_MAX_THREADS];  // занятые блоки, не принадлежащие ни одному файлу
+    int reserved[FSCK_MAX_THREADS]; // занятые записи FAT у блоков метаданных
+} FsckScan;
+
+typedef struct {
+    FsckScan *scan;
+    int part;
+    void (*work)(FsckScan *, int);
+} FsckTask;
+
+static int fsck_data_block(FsckScan *scan, int block) {
+    return block >= DATA_START && block < scan->sb.total_blocks;
+}
+
+static int fsck_in_use(FsckScan *scan, int i) {
+    if (i == FSCK_EXT(scan)) {
+        return scan->sb.dir_ext != -1;
+    }
+    if (i >= scan->slots) {
+        return i - scan->slots < scan->sb.reclaim_count;
+    }
+    return scan->dir[i].filename[0] != '\0' && !(scan->files[i].errors & (FSCK_BAD_ENTRY | FSCK_BAD_PARENT));
+}
+
+static int fsck_chain_head(FsckScan *scan, int i) {
+    if (i == FSCK_EXT(scan)) {
+        return scan->sb.dir_ext;
+    }
+    return (i < scan->slots) ? scan->dir[i].first_block : scan->sb.reclaim[i - scan->slots];
+}
+
+// Сколько блоков может быть в цепочке; у отложенных цепочек размера нет
+static int fsck_chain_needed(FsckScan *scan, int i) {
+    if (i == FSCK_EXT(scan)) {
+        return scan->ext_blocks;
+    }
+    if (i >= scan->slots) {
+        return scan->sb.total_blocks;
+    }
+    if (scan->dir[i].first_block == -1 && scan->dir[i].size <= scan->sb.inline_max) {
+        return 0; // данные в записи каталога
+    }
+    return (scan->dir[i].size + BLOCKSIZE - 1) / BLOCKSIZE;
+}
+
+// Проход 1: каждый блок достается файлу с наименьшим индексом,
+// чья цепочка через него проходит (атомарный минимум в owner)
+static void fsck_claim(FsckScan *scan, int part) {
+    int limit = scan->sb.total_blocks - DATA_START;
+
+    for (int i = part; i < scan->chains; i += scan->threads) {
+        if (!fsck_in_use(scan, i)) {
+            continue;
+        }
+        int block = fsck_chain_head(scan, i);
+        for (int steps = 0; steps < limit && fsck_data_block(scan, block); steps++) {
+            int current = __atomic_load_n(&scan->owner[block], __ATOMIC_RELAXED);
+            while ((current == 0 || current > i + 1) &&
+                   !__atomic_compare_exchange_n(&scan->owner[block], &current, i + 1, 0,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+            block = scan->fat[block];
+        }
+    }
+}
+
+// Проход 2: каждый файл проходит свою цепочку и оставляет себе блоки до
+// первой ошибки. seen[block] пишет только владелец блока, гонок нет.
+static void fsck_walk(FsckScan *scan, int part) {
+    for (int i = part; i < scan->chains; i += scan->threads) {
+        if (!fsck_in_use(scan, i)) {
+            continue;
+        }
+        FsckFile *file = &scan->files[i];
+        int needed = fsck_chain_needed(scan, i);
+        int block = fsck_chain_head(scan, i);
+
+        file->keep = 0;
+        file->last = -1;
+        if (block != -1) {
+            while (1) {
+                if (!fsck_data_block(scan, block)) {
+                    file->errors |= FSCK_BAD_POINTER;
+                } else if (scan->owner[block] != i + 1) {
+                    file->errors |= FSCK_CROSS_LINK;
+                    file->other = scan->owner[block] - 1;
+                } else if (scan->seen[block]) {
+                    file->errors |= FSCK_LOOP;
+                } else if (file->keep == needed) {
+                    file->errors |= FSCK_TOO_LONG;
+                } else {
+                    scan->seen[block] = 1;
+                    file->keep++;
+                    file->last = block;
+                    block = scan->fat[block];
+                    if (block == FAT_EOC) {
+                        break;
+                    }
+                    if (block == FAT_FREE) {
+                        file->errors |= FSCK_FREE_LINK;
+                        file->cut = 1;
+                        break;
+                    }
+                    continue;
+                }
+                file->cut = 1;
+                break;
+            }
+        }
+        if ((i < scan->slots || i == FSCK_EXT(scan)) && file->keep < needed) {
+            file->errors |= FSCK_TOO_SHORT;
+        }
+    }
+}
+
+// Проход 3: подсчет свободных и потерянных блоков по диапазонам FAT
+static void fsck_count(FsckScan *scan, int part) {
+    int total = scan->sb.total_blocks;
+    int from = (int) ((long) total * part / scan->threads);
+    int to = (int) ((long) total * (part + 1) / scan->threads);
+
+    for (int block = from; block < to; block++) {
+        if (block < DATA_START) {
+            if (scan->fat[block] != FAT_FREE) {
+                scan->reserved[part]++;
+            }
+        } else if (scan->fat[block] == FAT_FREE) {
+            scan->free_count[part]++;
+        } else if (!scan->seen[block]) {
+            scan->orphans[part]++;
+        }
+    }
+}
+
+static void *fsck_thread(void *arg) {
+    FsckTask *task = arg;
+    task->work(task->scan, task->part);
+    return NULL;
+}
+
+// Выполняем work(scan, part) для part = 0..threads-1 в отдельных потоках
+static void fsck_parallel(FsckScan *scan, void (*work)(FsckScan *, int)) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    FsckTask tasks[FSCK_MAX_THREADS];
+    int started[FSCK_MAX_THREADS];
+
+    for (int part = 0; part < scan->threads; part++) {
+        tasks[part].scan = scan;
+        tasks[part].part = part;
+        tasks[part].work = work;
+        started[part] = part > 0 && pthread_create(&threads[part], NULL, fsck_thread, &tasks[part]) == 0;
+        if (part > 0 && !started[part]) {
+            work(scan, part); // поток не создался - выполняем сами
+        }
+    }
+    work(scan, 0);
+    for (int part = 1; part < scan->threads; part++) {
+        if (started[part]) {
+            pthread_join(threads[part], NULL);
+        }
+    }
+}
+
+// Запись должна быть достижима из корня через каталоги. Путь вверх по
+// родителям помечается целиком (1 - достижима, 2 - нет, 3 - на пути),
+// поэтому каждая запись проходится один раз.
+static int fsck_check_parents(FsckScan *scan) {
+    unsigned char *state = calloc(scan->slots, 1);
+    int *path = malloc(scan->slots * sizeof(int));
+    if (state == NULL || path == NULL) {
+        free(state);
+        free(path);
+        return -1;
+    }
+
+    for (int i = 0; i < scan->slots; i++) {
+        if (!fsck_in_use(scan, i) || state[i] != 0) {
+            continue;
+        }
+        int depth = 0, result = 0;
+        for (int p = i; result == 0; ) {
+            if (p == DIR_ROOT) {
+                result = 1;
+            } else if (p < 0 || p >= scan->slots || !fsck_in_use(scan, p) ||
+                       (depth > 0 && scan->dir[p].type != DIR_TYPE_DIR)) {
+                result = 2; // родитель не каталог
+            } else if (state[p] != 0) {
+                result = (state[p] == 3) ? 2 : state[p]; // 3 - цикл
+            } else {
+                state[p] = 3;
+                path[depth++] = p;
+                p = scan->dir[p].parent;
+            }
+        }
+        while (depth > 0) {
+            state[path[--depth]] = result;
+        }
+    }
+    for (int i = 0; i < scan->slots; i++) {
+        if (state[i] == 2) {
+            scan->files[i].errors |= FSCK_BAD_PARENT;
+        }
+    }
+    free(state);
+    free(path);
+    return 0;
+}
+
+typedef struct {
+    int parent;
+    int index;
+    const char *name;
+} FsckName;
+
+static int fsck_name_compare(const void *a, const void *b) {
+    const FsckName *x = a, *y = b;
+    if (x->parent != y->parent) {
+        return (x->parent < y->parent) ? -1 : 1;
+    }
+    int c = strcmp(x->name, y->name);
+    return (c != 0) ? c : x->index - y->index;
+}
+
+// Повторяющиеся имена в одном каталоге: после сортировки по (родитель,
+// имя) они стоят рядом. Возвращает количество повторов или -1.
+static int fsck_check_names(FsckScan *scan) {
+    FsckName *names = malloc((scan->slots > 0 ? scan->slots : 1) * sizeof(FsckName));
+    if (names == NULL) {
+        return -1;
+    }
+    int count = 0, problems = 0;
+    for (int i = 0; i < scan->slots; i++) {
+        if (fsck_in_use(scan, i)) {
+            names[count].parent = scan->dir[i].parent;
+            names[count].index = i;
+            names[count].name = scan->dir[i].filename;
+            count++;
+        }
+    }
+    qsort(names, count, sizeof(FsckName), fsck_name_compare);
+    for (int k = 1; k < count; k++) {
+        if (names[k].parent == names[k - 1].parent && strcmp(names[k].name, names[k - 1].name) == 0) {
+            printf("fsck: duplicate file name %s (entries %d and %d)\n", names[k].name, names[k - 1].index, names[k].index);
+            problems++;
+        }
+    }
+    free(names);
+    return problems;
+}
+
+// Исправление по результатам проверки. Диск монтируется, изменения
+// делаются в памяти и фиксируются через журнал: каждое исправление -
+// шаг, между шагами транзакция может зафиксироваться. Прерванное
+// исправление оставляет диск не хуже прежнего, повторный запуск его
+// доделает.
+static int fsck_repair(char *vdiskname, FsckScan *scan) {
+    if (sfs_mount(vdiskname) == -1) {
+        return -1;
+    }
+    if (journal_reserve(JOURNAL_OP_BLOCKS) == -1) {
+        sfs_umount();
+        return -1;
+    }
+
+    // Цепочку продолжения обрываем; записи из отрезанных блоков теряются,
+    // их блоки на диск не пишем
+    FsckFile *ext = &scan->files[FSCK_EXT(scan)];
+    int slots = (scan->slots < dir_slots) ? scan->slots : dir_slots;
+    if (ext->cut) {
+        if (ext->last == -1) {
+            superblock.dir_ext = -1;
+        } else {
+            fat_set(ext->last, FAT_EOC);
+        }
+        if (slots > NUM_DIR_ENTRIES + ext->keep * DIR_ENTRIES_PER_BLOCK) {
+            slots = NUM_DIR_ENTRIES + ext->keep * DIR_ENTRIES_PER_BLOCK;
+        }
+    }
+
+    for (int i = 0; i < slots; i++) {
+        FsckFile *file = &scan->files[i];
+        if (journal_reserve(2) == -1) { // блок FAT и блок каталога
+            sfs_umount();
+            return -1;
+        }
+        if (file->errors & (FSCK_BAD_ENTRY | FSCK_BAD_PARENT)) {
+            // Монтирование могло уже пропустить запись; на диске она
+            // заменяется свободной, ее блоки освободятся как потерянные
+            memset(&directory_entries[i], 0, sizeof(DirectoryEntry));
+            directory_entries[i].first_block = -1;
+            directory_entries[i].parent = DIR_ROOT;
+            dir_mark_dirty(i);
+            continue;
+        }
+        if (directory_entries[i].filename[0] == '\0') {
+            continue;
+        }
+        if (file->cut) {
+            if (file->last == -1) {
+                directory_entries[i].first_block = -1;
+            } else {
+                fat_set(file->last, FAT_EOC);
+            }
+            dir_mark_dirty(i);
+        }
+        // Файл без блоков сохраняет данные из записи каталога
+        int room = file->keep * BLOCKSIZE;
+        if (!file->cut && directory_entries[i].first_block == -1) {
+            room = superblock.inline_max;
+        }
+        if (directory_entries[i].size > room) {
+            directory_entries[i].size = room;
+            dir_mark_dirty(i);
+        }
+    }
+
+    // Отложенные цепочки: обрываем так же, пустые убираем из очереди
+    int kept = 0;
+    if (journal_reserve(RECLAIM_MAX + 1) == -1) {
+        sfs_umount();
+        return -1;
+    }
+    for (int r = 0; r < superblock.reclaim_count; r++) {
+        FsckFile *chain = &scan->files[FSCK_RECLAIM(scan, r)];
+        if (chain->cut && chain->last != -1) {
+            fat_set(chain->last, FAT_EOC);
+        }
+        if (!chain->cut || chain->last != -1) {
+            superblock.reclaim[kept++] = superblock.reclaim[r];
+        }
+    }
+    superblock.reclaim_count = kept;
+
+    // Освобождаем потерянные блоки и пересчитываем свободное место
+    int free_blocks = 0;
+    for (int block = 0; block < superblock.total_blocks; block++) {
+        if (fat[block] != FAT_FREE && (block < DATA_START || !scan->seen[block])) {
+            if (journal_reserve(2) == -1) { // блок FAT и суперблок
+                sfs_umount();
+                return -1;
+            }
+            fat_set(block, FAT_FREE);
+        }
+        if (block >= DATA_START && fat[block] == FAT_FREE) {
+            free_blocks++;
+        }
+    }
+    if (journal_reserve(1) == -1) {
+        sfs_umount();
+        return -1;
+    }
+    superblock.free_blocks = free_blocks;
+    meta_mark_dirty(0);
+
+    return sfs_umount();
+}
+
+int sfs_fsck(char *vdiskname, int flags) {
+    struct timespec start, end;
+    struct stat st;
+    int problems = 0;
+
+    if (vdiskname == NULL) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Для исправления нужен диск без незавершенного журнала:
+    // монтирование повторит его хвост
+    if ((flags & FSCK_FIX) && (sfs_mount(vdiskname) == -1 || sfs_umount() == -1)) {
+        return -1;
+    }
+
+    int fd = open(vdiskname, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening virtual disk");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) DATA_START * BLOCKSIZE) {
+        fprintf(stderr, "fsck: %s is too small for an sfs file system\n", vdiskname);
+        close(fd);
+        return -1;
+    }
+    char *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    FsckScan *scan = calloc(1, sizeof(FsckScan));
+    if (image == MAP_FAILED || scan == NULL) {
+        perror("fsck");
+        if (image != MAP_FAILED) munmap(image, st.st_size);
+        free(scan);
+        close(fd);
+        return -1;
+    }
+
+    memcpy(&scan->sb, image, SUPERBLOCK_SIZE);
+    if (scan->sb.total_blocks <= DATA_START || scan->sb.total_blocks > FAT_ENTRIES ||
+        (off_t) scan->sb.total_blocks * BLOCKSIZE > st.st_size || scan->sb.journal_blocks != JOURNAL_BLOCKS ||
+        scan->sb.reclaim_count < 0 || scan->sb.reclaim_count > RECLAIM_MAX ||
+        scan->sb.inline_max < 0 || scan->sb.inline_max > INLINE_MAX ||
+        (scan->sb.dir_ext != -1 && (scan->sb.dir_ext < DATA_START || scan->sb.dir_ext >= scan->sb.total_blocks))) {
+        fprintf(stderr, "fsck: %s: bad superblock\n", vdiskname);
+        munmap(image, st.st_size);
+        free(scan);
+        close(fd);
+        return -1;
+    }
+    if (!scan->sb.clean) {
+        printf("fsck: %s was not unmounted cleanly, the journal will be replayed at mount\n", vdiskname);
+    }
+
+    // Таблицу записей декодируем в память тем же кодом, что и при
+    // монтировании, FAT читаем прямо из образа. Длину цепочки продолжения
+    // считаем до выхода за область данных или до повтора блока.
+    scan->fat = (const int *) (image + (size_t) FAT_START * BLOCKSIZE);
+    scan->owner = calloc(scan->sb.total_blocks, sizeof(int));
+    scan->seen = calloc(scan->sb.total_blocks, 1);
+    if (scan->owner == NULL || scan->seen == NULL) {
+        perror("fsck");
+        problems = -1;
+    } else {
+        for (int b = scan->sb.dir_ext; fsck_data_block(scan, b) && !scan->seen[b]; b = scan->fat[b]) {
+            scan->seen[b] = 1;
+            scan->ext_blocks++;
+        }
+        memset(scan->seen, 0, scan->sb.total_blocks);
+        scan->slots = NUM_DIR_ENTRIES + scan->ext_blocks * DIR_ENTRIES_PER_BLOCK;
+        scan->chains = scan->slots + RECLAIM_MAX + 1;
+        scan->dir = calloc(scan->slots, sizeof(DirectoryEntry));
+        scan->files = calloc(scan->chains, sizeof(FsckFile));
+        if (scan->dir == NULL || scan->files == NULL) {
+            perror("fsck");
+            problems = -1;
+        }
+    }
+
+    int files = 0, dirs = 0;
+    for (int i = 0, b = scan->sb.dir_ext; problems >= 0 && i < scan->slots; i++) {
+        const char *slot;
+        if (i < NUM_DIR_ENTRIES) {
+            slot = image + (size_t) ROOT_DIR_START * BLOCKSIZE + (size_t) i * DIR_ENTRY_SIZE;
+        } else {
+            int k = (i - NUM_DIR_ENTRIES) % DIR_ENTRIES_PER_BLOCK;
+            if (k == 0 && i > NUM_DIR_ENTRIES) {
+                b = scan->fat[b];
+            }
+            slot = image + (size_t) b * BLOCKSIZE + (size_t) k * DIR_ENTRY_SIZE;
+        }
+        int ret = dir_entry_decode(&scan->dir[i], slot);
+        if (ret == -1) {
+            scan->files[i].errors |= FSCK_BAD_ENTRY;
+        }
+        if (ret == 1) {
+            if (scan->dir[i].type == DIR_TYPE_DIR) {
+                dirs++;
+            } else {
+                files++;
+            }
+        }
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    scan->threads = cpus < 1 ? 1 : (cpus > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : (int) cpus);
+    if (problems >= 0 && fsck_check_parents(scan) == -1) {
+        perror("fsck");
+        problems = -1;
+    }
+    if (problems >= 0) {
+        int duplicates = fsck_check_names(scan);
+        problems = (duplicates == -1) ? -1 : problems + duplicates;
+    }
+    if (problems >= 0) {
+        fsck_parallel(scan, fsck_claim);
+        fsck_parallel(scan, fsck_walk);
+        fsck_parallel(scan, fsck_count);
+    }
+
+    // Отчет
+    int free_blocks = 0, orphans = 0, reserved = 0;
+    for (int part = 0; problems >= 0 && part < scan->threads; part++) {
+        free_blocks += scan->free_count[part];
+        orphans += scan->orphans[part];
+        reserved += scan->reserved[part];
+    }
+    for (int i = 0; problems >= 0 && i < scan->chains; i++) {
+        FsckFile *file = &scan->files[i];
+        if (file->errors == 0) {
+            continue;
+        }
+        problems++;
+        if (file->errors & FSCK_BAD_ENTRY) {
+            printf("fsck: directory entry %d is corrupted\n", i);
+            continue;
+        }
+        if (file->errors & FSCK_BAD_PARENT) {
+            printf("fsck: entry %s (%d) is not reachable from the root\n", scan->dir[i].filename, i);
+            continue;
+        }
+        if (i == FSCK_EXT(scan)) {
+            printf("fsck: directory extension chain (%d of %d blocks kept):", file->keep, scan->ext_blocks);
+        } else if (i >= scan->slots) {
+            printf("fsck: deferred free chain %d (%d blocks kept):", i - scan->slots, file->keep);
+        } else {
+            printf("fsck: file %s (size %d, %d blocks kept):", scan->dir[i].filename, scan->dir[i].size, file->keep);
+        }
+        if (file->errors & FSCK_BAD_POINTER) printf(" chain points outside the data area;");
+        if (file->errors & FSCK_CROSS_LINK) {
+            if (file->other < scan->slots) {
+                printf(" cross-linked with %s;", scan->dir[file->other].filename);
+            } else if (file->other == FSCK_EXT(scan)) {
+                printf(" cross-linked with the directory extension chain;");
+            } else {
+                printf(" cross-linked with deferred free chain %d;", file->other - scan->slots);
+            }
+        }
+        if (file->errors & FSCK_LOOP) printf(" chain loops;");
+        if (file->errors & FSCK_FREE_LINK) printf(" chain runs into a free block;");
+        if (file->errors & FSCK_TOO_LONG) printf(" chain longer than the size;");
+        if (file->errors & FSCK_TOO_SHORT) printf(" size larger than the chain;");
+        printf("\n");
+    }
+    if (problems >= 0) {
+        if (orphans > 0) {
+            printf("fsck: %d allocated blocks belong to no file\n", orphans);
+            problems++;
+        }
+        if (reserved > 0) {
+            printf("fsck: %d metadata blocks are marked allocated in the FAT\n", reserved);
+            problems++;
+        }
+        if (free_blocks != scan->sb.free_blocks) {
+            printf("fsck: superblock counts %d free blocks, the FAT has %d\n", scan->sb.free_blocks, free_blocks);
+            problems++;
+        }
+    }
+
+    munmap(image, st.st_size);
+    close(fd);
+    if (problems > 0 && (flags & FSCK_FIX)) {
+        if (fsck_repair(vdiskname, scan) == -1) {
+            problems = -1;
+        } else {
+            printf("fsck: %s repaired\n", vdiskname);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (problems >= 0) {
+        printf("fsck: %s: %d files, %d directories, %d deferred frees, %d of %d data blocks free, %d problems, %d threads, %.1f ms\n",
+               vdiskname, files, dirs, scan->sb.reclaim_count, free_blocks, scan->sb.total_blocks - DATA_START, problems, scan->threads,
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    free(scan->owner);
+    free(scan->seen);
+    free(scan->dir);
+    free(scan->files);
+    free(scan);
+    return problems;
+}
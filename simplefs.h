@@ -1,9 +1,125 @@
+#ifndef SIMPLEFS_H
+#define SIMPLEFS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define MODE_READ 0
 #define MODE_APPEND 1
 
 #define BLOCKSIZE 1024 // bytes
 
+#define MOUNT_DIRECT 0x1 // open the virtual disk with O_DIRECT
+#define MOUNT_SYNC 0x2   // commit the journal after every operation
+#define MOUNT_PUNCH_HOLES 0x4 // give freed blocks back to the host file system
+#define MOUNT_STATS 0x8  // print the operation statistics at sfs_umount
+
+#define FSCK_FIX 0x1 // sfs_fsck: repair the problems found
+
+#define SFS_TYPE_FILE 0 // SfsStat.type
+#define SFS_TYPE_DIR 1
+
+// File information returned by sfs_stat and sfs_readdir
+typedef struct {
+    char name[32];   // file name (last path component)
+    int type;        // SFS_TYPE_FILE or SFS_TYPE_DIR
+    int size;        // size in bytes
+    int blocks;      // data blocks used (0 if the data is in the directory entry)
+    int first_block; // first data block, -1 if none
+} SfsStat;
+
+// Operations with a latency histogram in SfsStats.ops
+#define SFS_OP_OPEN 0
+#define SFS_OP_CLOSE 1
+#define SFS_OP_CREATE 2
+#define SFS_OP_DELETE 3
+#define SFS_OP_READ 4
+#define SFS_OP_APPEND 5
+#define SFS_OP_PWRITE 6
+#define SFS_OP_TRUNCATE 7
+#define SFS_OP_SYNC 8
+#define SFS_OP_DISK_READ 9   // one pread of the virtual disk
+#define SFS_OP_DISK_WRITE 10 // one pwrite of the virtual disk
+#define SFS_OP_COUNT 11
+
+// Latency histogram buckets: values below 8 ns have a bucket each, above
+// that every power of two is split into 8 buckets (at most 12.5% wide)
+#define SFS_HIST_BUCKETS 320
+
+// Latency of one kind of operation
+typedef struct {
+    long long count;    // operations timed
+    long long total_ns; // their total time
+    long long hist[SFS_HIST_BUCKETS];
+} SfsLatency;
+
+// Counters returned by sfs_get_stats
+typedef struct {
+    SfsLatency ops[SFS_OP_COUNT];
+    long long read_block;      // read_block calls
+    long long write_block;     // write_block calls
+    long long blocks_read;     // blocks read by read_blocks
+    long long blocks_written;  // blocks written by write_blocks
+    long long cache_hits;      // block cache lookups served from memory
+    long long cache_misses;    // lookups that read a line from disk
+    long long fat_allocs;      // blocks allocated in the FAT
+    long long fat_frees;       // blocks freed in the FAT
+    long long journal_commits; // journal transactions written
+    long long bytes_read;      // returned by sfs_read
+    long long bytes_written;   // written by sfs_append and sfs_pwrite
+    long long cow_blocks;      // blocks copied before a write because a snapshot shares them
+    long long journal_replays; // journal transactions replayed by sfs_mount after an unclean shutdown
+} SfsStats;
+
+// Block I/O trace (sfs_trace_start). A record is one access of the block
+// layer: a read through the block cache, a bulk read past it, or a write.
+#define SFS_TRACE_READ 0
+#define SFS_TRACE_WRITE 1
+
+#define SFS_TRACE_HIT 0x1  // read served by the block cache
+#define SFS_TRACE_MISS 0x2 // read that loaded a cache line from disk
+#define SFS_TRACE_BULK 0x4 // multi-block transfer that bypasses the cache
+
+// Originating call of a record: SFS_OP_OPEN..SFS_OP_SYNC or one of these
+#define SFS_CALL_MOUNT 16
+#define SFS_CALL_UMOUNT 17
+#define SFS_CALL_FORMAT 18
+#define SFS_CALL_DEFRAG 19
+#define SFS_CALL_FALLOCATE 20
+#define SFS_CALL_OTHER 255
+
+typedef struct {
+    unsigned long long seq;     // internal: position in the ring + 1
+    unsigned long long time_ns; // start, since sfs_trace_start
+    int block;                  // first block
+    int count;                  // blocks
+    unsigned int latency_ns;
+    unsigned char op;           // SFS_TRACE_READ or SFS_TRACE_WRITE
+    unsigned char flags;        // SFS_TRACE_HIT, _MISS, _BULK
+    unsigned char call;         // originating call
+    unsigned char thread;       // small per-thread number
+} SfsTraceRecord;
+
+// Trace file: this header, then records records, oldest first
+#define SFS_TRACE_MAGIC "SFSTRACE"
+#define SFS_TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];        // SFS_TRACE_MAGIC without the trailing zero
+    int version;          // SFS_TRACE_VERSION
+    int record_size;      // sizeof(SfsTraceRecord)
+    int block_size;       // BLOCKSIZE
+    int cache_line_blocks; // blocks per block cache line
+    int cache_lines;      // lines in the block cache
+    int fat_start;        // first FAT block; blocks before it are the
+                          // superblock and the root directory
+    int journal_start;    // first journal block
+    int data_start;       // first data block
+    long long records;    // records in the file
+    long long dropped;    // older records overwritten in the ring
+} SfsTraceHeader;
+
 int create_vdisk (char *vdiskname, int m);
 /*
    This function will be used to create a virtual disk (as simple Linux file)
@@ -11,6 +127,8 @@ int create_vdisk (char *vdiskname, int m);
    The parameter m is used to set the size.
    Size will be 2^m bytes. If success, 0 will returned; if error, -1
    will be returned.
+   The file is created sparse: it takes host disk space only for the
+   blocks that are actually written.
 */
 
 int sfs_format (char *vdiskname);
@@ -18,11 +136,24 @@ int sfs_format (char *vdiskname);
   This function will be used to initialize/create
   an sfs file system on the virtual disk (high-level formatting the disk).
   On disk file system structures (like superblock, FAT, etc.) will be
-  initialized as part of this call.
+  initialized as part of this call. The mounted disk is formatted;
+  vdiskname is not used.
   If success, 0 will be returned. If error, -1 will be returned.
  */
 
 
+int sfs_format_inline (char *vdiskname, int inline_max);
+/*
+   Like sfs_format, but sets the inline threshold of the new file system:
+   a file of up to inline_max bytes (at most 76) is stored in its
+   directory entry instead of a data block, so creating, writing and
+   reading it touches a single directory block. When it grows past the
+   threshold, its data moves to a block. 0 disables inline data;
+   sfs_format uses the maximum.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+
 int sfs_mount (char *vdiskname);
 /*
    This function will be used to mount the file system, i.e., to
@@ -34,6 +165,38 @@ int sfs_mount (char *vdiskname);
    be returned.
  */
 
+int sfs_mount_flags (char *vdiskname, int flags);
+/*
+   The same as sfs_mount, but with mount options. flags is a bitwise OR
+   of MOUNT_* values, 0 gives the default buffered mount.
+   With MOUNT_DIRECT the virtual disk is opened with O_DIRECT, so the
+   data is cached only once, in the library block cache, and not in the
+   host page cache. All disk I/O is then done in aligned 4 KiB units from
+   aligned buffers, and multi-block writes are batched. The host file
+   system must support O_DIRECT, otherwise -1 is returned.
+   With MOUNT_SYNC every operation that changes metadata is committed
+   (and fsync'ed) before it returns, as with a call to sfs_sync.
+   With MOUNT_PUNCH_HOLES the space of freed blocks is returned to the
+   host file system (fallocate with FALLOC_FL_PUNCH_HOLE) once the free
+   is committed; neighbouring freed blocks are punched with one call.
+   sfs_format then also punches out the whole data area.
+   With MOUNT_STATS sfs_umount prints the statistics (see sfs_get_stats)
+   to stderr.
+ */
+
+int sfs_sync ();
+/*
+   Metadata changes (directory, FAT, superblock) are collected in a
+   journal transaction and reach the disk only when it is committed.
+   sfs_sync commits all operations done since the last commit with one
+   sequential journal write and one fsync, which also makes the file data
+   written by them durable. Operations done before a successful sfs_sync
+   survive a crash; later ones may be lost, but the file system stays
+   consistent. The transaction is also committed when it grows too big
+   and at sfs_umount.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
 int sfs_umount ();
 /*
    This function will be used to unmount the file system: flush the
@@ -49,13 +212,26 @@ int sfs_create(char *filename);
    use an entry in the root directory to store information
    about the created file, like its name, size, first data block
    number, etc.
+   filename may be a path such as "a/b/file" (a leading "/" is
+   optional); every directory on it must already exist, and each
+   component is at most 31 characters. Creating a name that already
+   exists in its directory fails.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+int sfs_mkdir(char *dirname);
+/*
+   Creates an empty directory; dirname is a path like in sfs_create.
+   Files and directories in it are created, opened, listed and deleted
+   through paths, which are resolved in memory without reading
+   directory blocks.
    If success, 0 will be returned. If error, -1 will be returned.
  */
 
 int sfs_open(char *filename, int mode);
 /*
    With  this an application will open a file. The name of the
-   file to open is filename. The mode paramater specifies if the
+   file to open is filename (a path, see sfs_create). The mode paramater specifies if the
    file will be opened in read-only mode or in append-only mode.
    if 0, read-only; if 1, append-only. We can either
    read the file or append to it. A file can not be opened for both
@@ -81,6 +257,36 @@ int sfs_getsize (int fd);
    Returns the number of data bytes in the file. If error, returns -1.
 */
 
+int sfs_stat(char *filename, SfsStat *st);
+/*
+   Fills st with the name, type, size, number of data blocks and first
+   data block of the file or directory at path filename. The file does
+   not need to be open.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+int sfs_opendir(char *dirname);
+/*
+   Starts a listing of the directory dirname ("/" is the root). The
+   listing works on a snapshot of the directory taken by
+   this call: files created or deleted later do not show up in it, and
+   the listing does not hold up those operations. Returns a directory
+   descriptor, or -1 on error.
+ */
+
+int sfs_readdir(int dd, SfsStat *entries, int max);
+/*
+   Copies up to max next files of the listing dd into entries, so a
+   large directory can be read in a few calls. Returns the number of
+   entries filled in, 0 when the listing is finished, or -1 on error.
+ */
+
+int sfs_closedir(int dd);
+/*
+   Ends the listing dd and frees its snapshot.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
 int sfs_read(int fd, void *buf, int n);
 /*
    With this, an application can read data from a file. fd is the
@@ -103,10 +309,210 @@ int sfs_append(int fd, void *buf, int n);
  */
 
 
+int sfs_fallocate(int fd, int bytes);
+/*
+   With this, an application can reserve space for a file opened in
+   append mode, so that it can grow to bytes bytes without allocating
+   blocks piece by piece. The missing blocks are reserved as one
+   contiguous run, right after the file's last block when that space is
+   free, and later appends through this descriptor fill them in order.
+   The file size does not change. The reservation is kept in memory
+   only: it is returned to the free space when the descriptor is closed
+   or the disk is unmounted. Every append descriptor also reserves a
+   small window of this kind by itself, so files appended to in turn do
+   not interleave their blocks.
+   If success, 0 will be returned. If there are not enough contiguous
+   free blocks, -1 will be returned.
+ */
+
+
+int sfs_truncate(int fd, int new_size);
+/*
+   With this, an application can change the size of a file opened in
+   append mode. If new_size is smaller than the size, the blocks past
+   the new end are freed; if larger, the file is extended with zero bytes.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+
+int sfs_pwrite(int fd, void *buf, int n, int offset);
+/*
+   With this, an application can overwrite n bytes of a file opened in
+   append mode, starting at byte offset. Bytes inside the file are
+   rewritten in place, in the blocks the file already has; the part past
+   the end of the file is appended. If offset is past the end, the gap is
+   filled with zero bytes. Upon failure, -1 will be returned. Otherwise,
+   the number of bytes successfully written will be returned.
+ */
+
+
 int sfs_delete(char *filename);
 /*
    With this, an application can delete a file. The name of the
    file to be deleted is filename. If succesful, 0 will be returned. 
    In case of an error, -1 will be returned. 
+   filename is a path; a directory can be deleted only when empty.
+   An open file can not be deleted. The directory entry is removed at
+   once, but the file's blocks are put on a deferred-free queue (kept in
+   the superblock, so it survives a crash) and freed in portions by later
+   allocations and by sfs_sync.
 */
 
+int sfs_defrag(int max_blocks);
+/*
+   Defragments the mounted file system a step at a time. Each call
+   moves at most max_blocks blocks, so an application can spread the
+   work between its own operations and limit the I/O it takes. A file
+   whose blocks are not contiguous is copied into a free extent large
+   enough for all of them, from its first block to its last. The chain
+   stays valid after every step, so files can be read, appended to and
+   committed while this runs. The extent is reserved until the move
+   finishes. Files for which no extent is free are left as they are.
+   Returns the number of blocks moved (0 - nothing is left to move), or
+   -1 on error.
+ */
+
+int sfs_fsck(char *vdiskname, int flags);
+/*
+   Checks the consistency of the file system on the virtual disk
+   vdiskname, which must not be mounted. The image is mapped read-only
+   and scanned by several threads: directory entries, FAT chains (bad
+   pointers, loops, blocks shared by two files), file sizes against chain
+   lengths, allocated blocks that belong to no file, and the free block
+   count in the superblock. Every problem is reported on stdout.
+   With FSCK_FIX the journal is replayed first and the problems are then
+   repaired: chains are cut at the first bad block, sizes are trimmed to
+   the chains, lost blocks are freed and the free count is recomputed.
+   Returns the number of problems found (0 - the file system is
+   consistent), or -1 if the disk could not be checked.
+ */
+
+int sfs_get_stats(SfsStats *stats);
+/*
+   Fills stats with the counters and latency histograms collected since
+   the program started or since the last sfs_reset_stats, summed over all
+   threads. They are kept whether or not a disk is mounted. Each thread
+   counts into its own block with relaxed atomic operations, so the
+   counting takes no locks; a sum taken while other threads run is not
+   an exact snapshot.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+int sfs_reset_stats();
+/*
+   Starts the statistics from zero; later sfs_get_stats calls return only
+   what happened after this call.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+long long sfs_stats_percentile(const SfsLatency *latency, double p);
+/*
+   Returns the latency in nanoseconds below which a fraction p (0..1) of
+   the operations in latency fell, as the upper end of its histogram
+   bucket; 0 if nothing was timed.
+ */
+
+int sfs_trace_start(int records);
+/*
+   Starts tracing block I/O into a ring buffer of records entries
+   (rounded up to a power of two); when it is full the oldest records
+   are overwritten. Threads claim ring slots with one atomic add, so
+   tracing takes no locks. A previous trace is discarded. Must not be
+   called while other threads are doing file system operations.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+int sfs_trace_stop();
+/*
+   Stops recording; the records stay in the ring for sfs_trace_dump.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+int sfs_trace_dump(char *path);
+/*
+   Writes the records in the ring, oldest first, to the file path in the
+   format described by SfsTraceHeader (see sfs_trace for an analyzer).
+   Tracing may go on meanwhile; records being overwritten during the
+   dump are left out. Returns the number of records written, or -1 on
+   error.
+ */
+
+#define SFS_RECORD_VERSION 1 // first line of a call log: "# sfs calls 1"
+
+int sfs_record_start(char *path);
+/*
+   Starts logging sfs_* calls to the text file path (replaced), one line
+   per call: "time_ns thread latency_ns call args... result", with sizes
+   but not the data (see sfs_replay). If a volume is mounted, its
+   directories ("init mkdir path") and files ("init file path size") are
+   written first so that the starting state can be rebuilt. A path is
+   written as one word: space, '%', control bytes and DEL become %XX
+   (hex), a NULL path becomes "-" and the path "-" itself %2D. Logged calls
+   are format, create, mkdir, open, close, read, append, pwrite,
+   truncate, fallocate, delete, stat, sync and defrag. A previous log is
+   closed.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+int sfs_record_stop();
+/*
+   Stops logging and closes the log file.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+#define SFS_MAX_SNAPSHOTS 8
+
+int sfs_snapshot();
+/*
+   Freezes the current directory table and FAT of the mounted disk as a
+   point-in-time snapshot and returns its number (0..SFS_MAX_SNAPSHOTS-1).
+   Only the tables are copied; data blocks are shared with the live file
+   system and reference-counted. A live write into a shared block goes
+   to a new block first (copy-on-write), and shared blocks freed by
+   truncate, delete or defrag are not reused until every snapshot that
+   holds them is released. Snapshots live in memory and are dropped by
+   sfs_umount and sfs_format.
+   If error, -1 will be returned.
+ */
+
+int sfs_snapshot_release(int snap);
+/*
+   Drops snapshot snap; blocks that only it held become free.
+   Must not run while another thread reads this snapshot.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+int sfs_snapshot_stat(int snap, char *path, SfsStat *st);
+/*
+   Fills st for the file or directory at path as of snapshot snap.
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+int sfs_snapshot_list(int snap, char *dirname, SfsStat *entries, int max);
+/*
+   Fills entries with up to max entries of directory dirname ("/" - the
+   root) as of snapshot snap. Returns the number filled, -1 on error.
+ */
+
+int sfs_snapshot_read(int snap, char *path, void *buf, int n, int offset);
+/*
+   Reads up to n bytes of file path as of snapshot snap, starting at
+   offset. Returns the number of bytes read (0 at the end of the file)
+   or -1 on error.
+   The snapshot calls only read the snapshot's own tables and its blocks
+   on disk, so one thread may read or export a snapshot while others
+   keep using the live file system (under their usual serialization).
+ */
+
+int sfs_snapshot_export(int snap, char *hostdir);
+/*
+   Copies the directories and files of snapshot snap into the host
+   directory hostdir (created if needed; existing files are replaced).
+   If success, 0 will be returned. If error, -1 will be returned.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,208 @@
+#pragma once
+
+// C++17 interface to simplefs: RAII volume and move-only file handles.
+// Header-only; every call is an inline forward to the C function, with
+// no copies of the data and no allocations except when an error is thrown.
+
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "simplefs.h"
+
+namespace sfs {
+
+// A C call returned -1; what() names the call.
+class Error : public std::runtime_error {
+public:
+    explicit Error(const char *call) : std::runtime_error(call) {}
+};
+
+enum class Mode { read = MODE_READ, append = MODE_APPEND };
+
+using Stat = SfsStat;
+
+namespace detail {
+
+inline int check(int ret, const char *call) {
+    if (ret < 0) {
+        throw Error(call);
+    }
+    return ret;
+}
+
+inline int length(std::size_t bytes, const char *call) {
+    if (bytes > static_cast<std::size_t>(std::numeric_limits<int>::max())) {
+        throw Error(call);
+    }
+    return static_cast<int>(bytes);
+}
+
+// The C API does not modify paths; it only lacks const.
+inline char *path(const char *p) { return const_cast<char *>(p); }
+
+// Contiguous buffers: std::span (C++20), std::vector, std::array,
+// std::string, C arrays - anything with std::data and std::size.
+template <class Buffer>
+using Element = std::remove_pointer_t<decltype(std::data(std::declval<Buffer &>()))>;
+
+template <class Buffer>
+using IfBuffer = std::enable_if_t<std::is_trivially_copyable_v<Element<Buffer>>, std::size_t>;
+
+template <class Buffer>
+std::size_t bytes(Buffer &buffer) {
+    return std::size(buffer) * sizeof(Element<Buffer>);
+}
+
+} // namespace detail
+
+// An open file. Move-only; the descriptor is closed by the destructor.
+class File {
+public:
+    File() noexcept = default;
+    explicit File(int fd) noexcept : fd_(fd) {}
+    File(File &&other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+    File &operator=(File &&other) noexcept {
+        if (this != &other) {
+            reset();
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+    File(const File &) = delete;
+    File &operator=(const File &) = delete;
+    ~File() { reset(); }
+
+    int fd() const noexcept { return fd_; }
+    explicit operator bool() const noexcept { return fd_ >= 0; }
+
+    // Gives up ownership without closing.
+    int release() noexcept { return std::exchange(fd_, -1); }
+
+    void close() { detail::check(sfs_close(std::exchange(fd_, -1)), "sfs_close"); }
+
+    // Reads up to n bytes from the current position; returns the count,
+    // 0 at the end of the file.
+    std::size_t read(void *buf, std::size_t n) {
+        return detail::check(sfs_read(fd_, buf, detail::length(n, "sfs_read")), "sfs_read");
+    }
+    template <class Buffer>
+    auto read(Buffer &&buf) -> detail::IfBuffer<Buffer> {
+        static_assert(!std::is_const_v<detail::Element<Buffer>>, "read needs a writable buffer");
+        return read(std::data(buf), detail::bytes(buf));
+    }
+
+    // Appends n bytes; returns the count written, less than n if the disk
+    // filled up.
+    std::size_t append(const void *buf, std::size_t n) {
+        return detail::check(sfs_append(fd_, const_cast<void *>(buf), detail::length(n, "sfs_append")),
+                             "sfs_append");
+    }
+    template <class Buffer>
+    auto append(const Buffer &buf) -> detail::IfBuffer<const Buffer> {
+        return append(std::data(buf), detail::bytes(buf));
+    }
+
+    // Overwrites n bytes at offset (up to the end of the file).
+    std::size_t pwrite(const void *buf, std::size_t n, int offset) {
+        return detail::check(sfs_pwrite(fd_, const_cast<void *>(buf), detail::length(n, "sfs_pwrite"), offset),
+                             "sfs_pwrite");
+    }
+    template <class Buffer>
+    auto pwrite(const Buffer &buf, int offset) -> detail::IfBuffer<const Buffer> {
+        return pwrite(std::data(buf), detail::bytes(buf), offset);
+    }
+
+    void truncate(int size) { detail::check(sfs_truncate(fd_, size), "sfs_truncate"); }
+    void fallocate(int bytes) { detail::check(sfs_fallocate(fd_, bytes), "sfs_fallocate"); }
+    int size() const { return detail::check(sfs_getsize(fd_), "sfs_getsize"); }
+
+private:
+    void reset() noexcept {
+        if (fd_ >= 0) {
+            sfs_close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    int fd_ = -1;
+};
+
+// The mounted virtual disk. The library keeps one volume per process, so
+// at most one Volume may exist at a time. Move-only; unmounts on
+// destruction.
+class Volume {
+public:
+    // Creates a virtual disk of 2^m bytes; does not mount it.
+    static void create(const char *path, int m) { detail::check(create_vdisk(detail::path(path), m), "create_vdisk"); }
+    static void create(const std::string &path, int m) { create(path.c_str(), m); }
+
+    explicit Volume(const char *path, int flags = 0) {
+        detail::check(sfs_mount_flags(detail::path(path), flags), "sfs_mount");
+        mounted_ = true;
+    }
+    explicit Volume(const std::string &path, int flags = 0) : Volume(path.c_str(), flags) {}
+    Volume(Volume &&other) noexcept : mounted_(std::exchange(other.mounted_, false)) {}
+    Volume &operator=(Volume &&other) noexcept {
+        if (this != &other) {
+            reset();
+            mounted_ = std::exchange(other.mounted_, false);
+        }
+        return *this;
+    }
+    Volume(const Volume &) = delete;
+    Volume &operator=(const Volume &) = delete;
+    ~Volume() { reset(); }
+
+    void umount() {
+        mounted_ = false;
+        detail::check(sfs_umount(), "sfs_umount");
+    }
+
+    // Formats the mounted disk; inline_max - see sfs_format_inline.
+    void format() { detail::check(sfs_format(nullptr), "sfs_format"); }
+    void format(int inline_max) { detail::check(sfs_format_inline(nullptr, inline_max), "sfs_format_inline"); }
+
+    void create(const char *path) { detail::check(sfs_create(detail::path(path)), "sfs_create"); }
+    void create(const std::string &path) { create(path.c_str()); }
+    void mkdir(const char *path) { detail::check(sfs_mkdir(detail::path(path)), "sfs_mkdir"); }
+    void mkdir(const std::string &path) { mkdir(path.c_str()); }
+    void remove(const char *path) { detail::check(sfs_delete(detail::path(path)), "sfs_delete"); }
+    void remove(const std::string &path) { remove(path.c_str()); }
+
+    File open(const char *path, Mode mode) {
+        return File(detail::check(sfs_open(detail::path(path), static_cast<int>(mode)), "sfs_open"));
+    }
+    File open(const std::string &path, Mode mode) { return open(path.c_str(), mode); }
+
+    Stat stat(const char *path) {
+        Stat st;
+        detail::check(sfs_stat(detail::path(path), &st), "sfs_stat");
+        return st;
+    }
+    Stat stat(const std::string &path) { return stat(path.c_str()); }
+    bool exists(const char *path) {
+        Stat st;
+        return sfs_stat(detail::path(path), &st) == 0;
+    }
+    bool exists(const std::string &path) { return exists(path.c_str()); }
+
+    void sync() { detail::check(sfs_sync(), "sfs_sync"); }
+    int defrag(int max_blocks) { return detail::check(sfs_defrag(max_blocks), "sfs_defrag"); }
+
+private:
+    void reset() noexcept {
+        if (mounted_) {
+            sfs_umount();
+            mounted_ = false;
+        }
+    }
+
+    bool mounted_ = false;
+};
+
+} // namespace sfs
@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "simplefs.h"
+
+/**
+ * Анализ трассы блочного ввода-вывода (sfs_trace_dump):
+ * ./sfs_trace [-c lines,lines,...] trace.bin
+ *      -c - размеры кэша в строках для кривой промахов LRU
+ *           (по умолчанию 16,32,64,128,256,1024,4096)
+ * Отчет:
+ *  - записи по вызовам sfs_* и по видам доступа с задержками p50/p99;
+ *  - области диска (метаданные, журнал, данные) и самые горячие блоки;
+ *  - локальность: доля последовательных доступов и средняя длина
+ *    последовательной серии в области данных (короткие серии -
+ *    фрагментированные файлы), количество разрывов на МБ;
+ *  - доля повторных чтений и перезаписей блоков;
+ *  - кривая промахов LRU по строкам кэша (расстояния повторного
+ *    использования) для подбора размера кэша.
+ */
+
+#define MAX_SIZES 16
+#define HOT_BLOCKS 10
+
+static SfsTraceHeader header;
+static SfsTraceRecord *records;
+static long long count;
+
+static const char *call_name(int call) {
+    static const char *ops[SFS_OP_COUNT] = {
+        "open", "close", "create", "delete", "read", "append", "pwrite",
+        "truncate", "sync", "disk_read", "disk_write"
+    };
+    if (call < SFS_OP_COUNT) return ops[call];
+    switch (call) {
+    case SFS_CALL_MOUNT: return "mount";
+    case SFS_CALL_UMOUNT: return "umount";
+    case SFS_CALL_FORMAT: return "format";
+    case SFS_CALL_DEFRAG: return "defrag";
+    case SFS_CALL_FALLOCATE: return "fallocate";
+    default: return "other";
+    }
+}
+
+static const char *region_name(int block) {
+    if (block == 0) return "superblock";
+    if (block < header.fat_start) return "directory";
+    if (block < header.journal_start) return "fat";
+    if (block < header.data_start) return "journal";
+    return "data";
+}
+
+static int compare_uint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_long_desc(const void *a, const void *b) {
+    const long long *x = a, *y = b;
+    return (x[1] < y[1]) - (x[1] > y[1]);
+}
+
+// Задержки записей одного вида: количество, блоки, среднее, p50, p99
+static void report_kind(const char *name, int op, int flags) {
+    unsigned int *lat = malloc((count > 0 ? count : 1) * sizeof(unsigned int));
+    long long n = 0, blocks = 0;
+    double total = 0;
+
+    if (lat == NULL) {
+        return;
+    }
+    for (long long i = 0; i < count; i++) {
+        if (records[i].op == op && records[i].flags == flags) {
+            lat[n++] = records[i].latency_ns;
+            blocks += records[i].count;
+            total += records[i].latency_ns;
+        }
+    }
+    if (n > 0) {
+        qsort(lat, n, sizeof(unsigned int), compare_uint);
+        printf("  %-12s %10lld %10lld %10.2f %10.2f %10.2f\n", name, n, blocks,
+               total / n / 1e3, lat[(n - 1) / 2] / 1e3, lat[(long long) ((n - 1) * 0.99)] / 1e3);
+    }
+    free(lat);
+}
+
+// Fenwick-дерево по номерам записей: отмечены последние обращения к строкам
+static void fenwick_add(int *tree, long long n, long long i, int value) {
+    for (i++; i <= n; i += i & -i) tree[i] += value;
+}
+
+static long long fenwick_sum(int *tree, long long i) {
+    long long sum = 0;
+    for (; i > 0; i -= i & -i) sum += tree[i];
+    return sum;
+}
+
+// Кривая промахов LRU: расстояние повторного использования строки -
+// количество разных строк между двумя обращениями к ней; обращение
+// попадает в кэш из size строк, если расстояние меньше size
+static void report_lru(int max_block, int *sizes, int nsizes) {
+    int lines = max_block / header.cache_line_blocks + 1;
+    long long *last = malloc(lines * sizeof(long long));
+    int *tree = calloc(count + 1, sizeof(int));
+    long long *hits = calloc(nsizes, sizeof(long long));
+    long long reads = 0, cold = 0, actual_hits = 0;
+
+    if (last == NULL || tree == NULL || hits == NULL) {
+        perror("sfs_trace");
+        free(last);
+        free(tree);
+        free(hits);
+        return;
+    }
+    for (int i = 0; i < lines; i++) {
+        last[i] = -1;
+    }
+    for (long long i = 0; i < count; i++) {
+        SfsTraceRecord *r = &records[i];
+        if (r->op != SFS_TRACE_READ || (r->flags & SFS_TRACE_BULK)) {
+            continue; // через кэш идут только поблочные чтения
+        }
+        int line = r->block / header.cache_line_blocks;
+        reads++;
+        actual_hits += (r->flags & SFS_TRACE_HIT) != 0;
+        if (last[line] == -1) {
+            cold++;
+        } else {
+            long long distance = fenwick_sum(tree, i) - fenwick_sum(tree, last[line] + 1);
+            for (int k = 0; k < nsizes; k++) {
+                if (distance < sizes[k]) hits[k]++;
+            }
+            fenwick_add(tree, count, last[line], -1);
+        }
+        fenwick_add(tree, count, i, 1);
+        last[line] = i;
+    }
+
+    printf("\ncache (%d-block lines), %lld cached reads, %lld first touches\n",
+           header.cache_line_blocks, reads, cold);
+    if (reads > 0) {
+        printf("  recorded hit ratio (direct-mapped, %d lines): %.3f\n",
+               header.cache_lines, (double) actual_hits / reads);
+        printf("  %-10s %10s %12s\n", "lru_lines", "size_KiB", "hit_ratio");
+        for (int k = 0; k < nsizes; k++) {
+            printf("  %-10d %10d %12.3f\n", sizes[k],
+                   sizes[k] * header.cache_line_blocks * header.block_size / 1024, (double) hits[k] / reads);
+        }
+    }
+    free(last);
+    free(tree);
+    free(hits);
+}
+
+int main(int argc, char **argv)
+{
+    int sizes[MAX_SIZES] = {16, 32, 64, 128, 256, 1024, 4096};
+    int nsizes = 7;
+    int i;
+
+    for (i = 1; i < argc - 1; i += 2) {
+        if (strcmp(argv[i], "-c") == 0) {
+            char *p = argv[i + 1];
+            nsizes = 0;
+            while (nsizes < MAX_SIZES && *p != '\0') {
+                sizes[nsizes] = (int) strtol(p, &p, 10);
+                if (sizes[nsizes] <= 0) break;
+                nsizes++;
+                if (*p == ',') p++;
+            }
+            if (nsizes == 0 || *p != '\0') break;
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        printf("usage: %s [-c lines,lines,...] trace.bin\n", argv[0]);
+        return 2;
+    }
+
+    FILE *file = fopen(argv[argc - 1], "rb");
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, SFS_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SFS_TRACE_VERSION || header.record_size != (int) sizeof(SfsTraceRecord) ||
+        header.records < 0 || header.cache_line_blocks <= 0) {
+        fprintf(stderr, "sfs_trace: %s is not an sfs trace\n", argv[argc - 1]);
+        return 2;
+    }
+    records = malloc((header.records > 0 ? header.records : 1) * sizeof(SfsTraceRecord));
+    if (records == NULL) {
+        perror("sfs_trace");
+        return 2;
+    }
+    count = fread(records, sizeof(SfsTraceRecord), header.records, file);
+    fclose(file);
+
+    int max_block = 0, threads = 0;
+    for (long long k = 0; k < count; k++) {
+        if (records[k].block < 0 || records[k].count <= 0) {
+            records[k].count = 0; // испорченная запись
+            continue;
+        }
+        int end = records[k].block + records[k].count - 1;
+        if (end > max_block) max_block = end;
+        if (records[k].thread + 1 > threads) threads = records[k].thread + 1;
+    }
+    double span = (count > 0) ? (records[count - 1].time_ns - records[0].time_ns) / 1e9 : 0;
+    printf("%lld records (%lld dropped), %d threads, %.3f s\n", count, header.dropped, threads, span);
+
+    // По вызовам
+    long long call_records[256][2] = {{0}}, call_blocks[256][2] = {{0}};
+    for (long long k = 0; k < count; k++) {
+        call_records[records[k].call][records[k].op & 1]++;
+        call_blocks[records[k].call][records[k].op & 1] += records[k].count;
+    }
+    printf("\n  %-12s %10s %12s %10s %12s\n", "call", "reads", "read_blocks", "writes", "write_blocks");
+    for (int c = 0; c < 256; c++) {
+        if (call_records[c][0] + call_records[c][1] > 0) {
+            printf("  %-12s %10lld %12lld %10lld %12lld\n", call_name(c), call_records[c][0], call_blocks[c][0],
+                   call_records[c][1], call_blocks[c][1]);
+        }
+    }
+
+    printf("\n  %-12s %10s %10s %10s %10s %10s\n", "access", "records", "blocks", "avg_us", "p50_us", "p99_us");
+    report_kind("read_hit", SFS_TRACE_READ, SFS_TRACE_HIT);
+    report_kind("read_miss", SFS_TRACE_READ, SFS_TRACE_MISS);
+    report_kind("read_bulk", SFS_TRACE_READ, SFS_TRACE_BULK);
+    report_kind("write", SFS_TRACE_WRITE, 0);
+    report_kind("write_bulk", SFS_TRACE_WRITE, SFS_TRACE_BULK);
+
+    // Обращения к блокам: повторные чтения, перезаписи, горячие блоки
+    long long (*per_block)[2] = calloc(max_block + 1, sizeof(*per_block)); // чтения, записи
+    long long (*hot)[2] = calloc(max_block + 1, sizeof(*hot));
+    if (per_block == NULL || hot == NULL) {
+        perror("sfs_trace");
+        return 2;
+    }
+    long long block_reads = 0, rereads = 0, block_writes = 0, rewrites = 0;
+    long long region[5][2] = {{0}};
+    for (long long k = 0; k < count; k++) {
+        SfsTraceRecord *r = &records[k];
+        for (int b = r->block; b < r->block + r->count; b++) {
+            int op = r->op & 1;
+            if (op == SFS_TRACE_READ) {
+                block_reads++;
+                rereads += per_block[b][0] > 0;
+            } else {
+                block_writes++;
+                rewrites += per_block[b][1] > 0;
+            }
+            per_block[b][op]++;
+            int g = (b == 0) ? 0 : (b < header.fat_start) ? 1 : (b < header.journal_start) ? 2 :
+                    (b < header.data_start) ? 3 : 4;
+            region[g][op]++;
+        }
+    }
+    int touched = 0;
+    for (int b = 0; b <= max_block; b++) {
+        hot[b][0] = b;
+        hot[b][1] = per_block[b][0] + per_block[b][1];
+        touched += hot[b][1] > 0;
+    }
+    printf("\n  %-12s %12s %12s\n", "region", "block_reads", "block_writes");
+    static const char *regions[5] = {"superblock", "directory", "fat", "journal", "data"};
+    for (int g = 0; g < 5; g++) {
+        printf("  %-12s %12lld %12lld\n", regions[g], region[g][0], region[g][1]);
+    }
+    printf("\n%d distinct blocks touched (%.1f MiB)\n", touched, touched * (double) header.block_size / (1 << 20));
+    printf("re-read ratio %.3f (%lld of %lld block reads), rewrite ratio %.3f (%lld of %lld block writes)\n",
+           block_reads ? (double) rereads / block_reads : 0.0, rereads, block_reads,
+           block_writes ? (double) rewrites / block_writes : 0.0, rewrites, block_writes);
+    qsort(hot, max_block + 1, sizeof(*hot), compare_long_desc);
+    printf("hottest blocks:");
+    for (int k = 0; k < HOT_BLOCKS && k <= max_block && hot[k][1] > 0; k++) {
+        printf(" %lld (%s, %lld)", hot[k][0], region_name((int) hot[k][0]), hot[k][1]);
+    }
+    printf("\n");
+
+    // Локальность в области данных: серия продолжается, если доступ того
+    // же потока и вида начинается сразу за предыдущим
+    int prev_end[256][2];
+    long long runs = 0, run_blocks = 0, sequential = 0, data_records = 0;
+    for (int t = 0; t < 256; t++) {
+        prev_end[t][0] = prev_end[t][1] = -1;
+    }
+    for (long long k = 0; k < count; k++) {
+        SfsTraceRecord *r = &records[k];
+        if (r->block < header.data_start || r->count == 0) {
+            continue;
+        }
+        int *end = &prev_end[r->thread][r->op & 1];
+        data_records++;
+        if (r->block == *end || r->block == *end - 1) {
+            sequential++; // следующий блок или снова последний (мелкие запросы)
+        } else {
+            runs++;
+        }
+        run_blocks += r->count;
+        *end = r->block + r->count;
+    }
+    printf("\ndata area locality: %lld accesses, sequential %.3f, %lld runs, mean run %.1f blocks, %.1f breaks per MiB\n",
+           data_records, data_records ? (double) sequential / data_records : 0.0, runs,
+           runs ? (double) run_blocks / runs : 0.0,
+           run_blocks ? runs / (run_blocks * (double) header.block_size / (1 << 20)) : 0.0);
+
+    report_lru(max_block, sizes, nsizes);
+
+    free(per_block);
+    free(hot);
+    free(records);
+    return 0;
+}